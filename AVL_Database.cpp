@@ -2,23 +2,422 @@
 #include "AVL_Database.hpp"
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <string_view>
+#include <atomic>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#define NOMINMAX // Keep std::min and std::max usable
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-Record::Record(const std::string &k, int v) : key(k), value(v) {}
+namespace
+{
+    struct CounterBlock
+    {
+        std::atomic<unsigned long long> searches{0}, inserts{0}, deletes{0}, comparisons{0}, rotations{0};
+        std::atomic<unsigned long long> cacheHits{0}, cacheMisses{0};
+        std::atomic<unsigned long long> latency[OperationCounters::TimedOps][OperationCounters::LatencyBuckets] = {};
+        std::atomic<unsigned long long> latencyNanos[OperationCounters::TimedOps] = {};
+    };
+
+    // Owner-thread-only increment: a plain load/store pair, readers on other threads still see a consistent value
+    void bump(std::atomic<unsigned long long> &counter, unsigned long long amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void accumulate(OperationCounters::Totals &totals, const CounterBlock &block)
+    {
+        totals.searches += block.searches.load(std::memory_order_relaxed);
+        totals.inserts += block.inserts.load(std::memory_order_relaxed);
+        totals.deletes += block.deletes.load(std::memory_order_relaxed);
+        totals.comparisons += block.comparisons.load(std::memory_order_relaxed);
+        totals.rotations += block.rotations.load(std::memory_order_relaxed);
+        totals.cacheHits += block.cacheHits.load(std::memory_order_relaxed);
+        totals.cacheMisses += block.cacheMisses.load(std::memory_order_relaxed);
+        for (int op = 0; op < OperationCounters::TimedOps; op++)
+        {
+            for (int bucket = 0; bucket < OperationCounters::LatencyBuckets; bucket++)
+                totals.latency[op][bucket] += block.latency[op][bucket].load(std::memory_order_relaxed);
+            totals.latencyNanos[op] += block.latencyNanos[op].load(std::memory_order_relaxed);
+        }
+    }
+
+    struct CounterRegistry
+    {
+        std::mutex mutex;
+        std::vector<CounterBlock *> live;
+        OperationCounters::Totals retired; // Counts from threads that have already exited
+    };
+
+    CounterRegistry &registry()
+    {
+        static CounterRegistry instance;
+        return instance;
+    }
+
+    struct ThreadCounters
+    {
+        CounterBlock block;
+
+        ThreadCounters()
+        {
+            CounterRegistry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.live.push_back(&block);
+        }
+
+        ~ThreadCounters()
+        {
+            CounterRegistry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            accumulate(r.retired, block);
+            r.live.erase(std::find(r.live.begin(), r.live.end(), &block));
+        }
+    };
+
+    CounterBlock &threadCounters()
+    {
+        thread_local ThreadCounters counters; // Registered once per thread, on its first operation
+        return counters.block;
+    }
+}
+
+/*
+Reorders records sorted by (key, value) into (value, key) order. A stable sort on the value alone is enough,
+since records with equal values are already in key order, and it never compares strings.
+*/
+static std::vector<Record *> sortedByValue(const std::vector<Record *> &byKey)
+{
+    std::vector<std::pair<int, Record *>> tagged;
+    tagged.reserve(byKey.size());
+    for (Record *record : byKey)
+        tagged.push_back({record->value, record});
+    std::stable_sort(tagged.begin(), tagged.end(), [](const std::pair<int, Record *> &a, const std::pair<int, Record *> &b)
+                     { return a.first < b.first; });
+    std::vector<Record *> byValue;
+    byValue.reserve(byKey.size());
+    for (const auto &entry : tagged)
+        byValue.push_back(entry.second);
+    return byValue;
+}
+
+/*
+How many levels of a divide and conquer fork onto other threads: enough for one task per hardware thread
+*/
+static int parallelDepthFor(bool parallel)
+{
+    int depth = 0;
+    if (parallel)
+    {
+        unsigned threads = std::thread::hardware_concurrency();
+        while ((1u << depth) < threads)
+            depth++;
+    }
+    return depth;
+}
+
+/*
+Index of the first byte at or after from where a and b differ, or n if they agree up to n.
+Compares 32 bytes per step with AVX2 and 16 with SSE2 when the compiler targets them, bytewise otherwise.
+*/
+static size_t mismatchFrom(const char *a, const char *b, size_t n, size_t from)
+{
+    size_t i = from;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        unsigned differ = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (differ)
+            return i + __builtin_ctz(differ);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        unsigned differ = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFFu;
+        if (differ)
+            return i + __builtin_ctz(differ);
+    }
+#endif
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/*
+Three-way compare of key against another key known by an inline prefix of prefixBytes and its length
+(lengths above prefixBytes may be saturated). fullKey() is only called when the prefix cannot decide.
+*/
+template <typename FullKey>
+static int comparePrefixed(std::string_view key, const char *prefix, size_t prefixBytes, size_t otherLength, FullKey fullKey)
+{
+    size_t keyInline = std::min(key.size(), prefixBytes);
+    size_t otherInline = std::min(otherLength, prefixBytes);
+    int cmp = std::memcmp(key.data(), prefix, std::min(keyInline, otherInline));
+    if (cmp != 0)
+        return cmp;
+    if (keyInline != otherInline)
+        return keyInline < otherInline ? -1 : 1; // The shorter key ends inside the prefix, so it sorts first
+    if (keyInline < prefixBytes)
+        return 0; // Both keys fit inline and match completely
+
+    if (otherLength <= prefixBytes || key.size() == prefixBytes)
+        return key.size() == otherLength ? 0 : (key.size() < otherLength ? -1 : 1); // One side ends exactly at the prefix
+    return std::string_view(key).substr(prefixBytes).compare(fullKey().substr(prefixBytes));
+}
+
+// OperationCounters Implementation
+OperationCounters::Totals OperationCounters::totals()
+{
+    CounterRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Totals totals = r.retired;
+    for (const CounterBlock *block : r.live)
+        accumulate(totals, *block);
+    return totals;
+}
+
+OperationCounters::Totals OperationCounters::thisThread()
+{
+    Totals totals;
+    accumulate(totals, threadCounters());
+    return totals;
+}
+
+void OperationCounters::addSearch(int count) { bump(threadCounters().searches, count); }
+void OperationCounters::addInsert(int count) { bump(threadCounters().inserts, count); }
+void OperationCounters::addDelete(int count) { bump(threadCounters().deletes, count); }
+void OperationCounters::addComparisons(int count) { bump(threadCounters().comparisons, count); }
+void OperationCounters::addRotation() { bump(threadCounters().rotations, 1); }
+void OperationCounters::addCacheHit() { bump(threadCounters().cacheHits, 1); }
+void OperationCounters::addCacheMiss() { bump(threadCounters().cacheMisses, 1); }
+
+void OperationCounters::addLatency(TimedOp op, unsigned long long nanos)
+{
+    int bucket = 0;
+    while (bucket < LatencyBuckets - 1 && (nanos >> bucket) != 0)
+        bucket++; // Bit length of nanos; a handful of shifts next to the clock reads that produced it
+    CounterBlock &block = threadCounters();
+    bump(block.latency[op][bucket], 1);
+    bump(block.latencyNanos[op], nanos);
+}
+unsigned long long OperationCounters::threadRotations() { return threadCounters().rotations.load(std::memory_order_relaxed); }
 
-AVLNode::AVLNode(Record *r) : record(r), left(nullptr), right(nullptr), height(1) {}
+// KeyArena Implementation
+KeyArena::KeyArena() : bump(nullptr), bumpEnd(nullptr), liveKeys(0), liveBytes(0)
+{
+    std::fill(std::begin(freeLists), std::end(freeLists), nullptr);
+}
+
+std::string_view KeyArena::store(std::string_view key)
+{
+    size_t bytes = blockBytes(key.size());
+    char *block;
+    if (bytes > MaxPooledBytes)
+    {
+        block = static_cast<char *>(::operator new(bytes));
+        largeBlocks.insert(std::upper_bound(largeBlocks.begin(), largeBlocks.end(), block, std::less<char *>()), block);
+    }
+    else if (freeLists[bytes / Granularity])
+    {
+        block = freeLists[bytes / Granularity];
+        std::memcpy(&freeLists[bytes / Granularity], block, sizeof(char *));
+    }
+    else
+    {
+        if ((size_t)(bumpEnd - bump) < bytes)
+        {
+            chunks.push_back(static_cast<char *>(::operator new(ChunkBytes)));
+            bump = chunks.back();
+            bumpEnd = bump + ChunkBytes; // The old chunk's tail is left unused
+        }
+        block = bump;
+        bump += bytes;
+    }
+    std::uint32_t references = 1;
+    std::memcpy(block, &references, sizeof(references));
+    if (!key.empty())
+        std::memcpy(block + sizeof(references), key.data(), key.size());
+    liveKeys++;
+    liveBytes += bytes;
+    return std::string_view(block + sizeof(references), key.size());
+}
+
+std::string_view KeyArena::share(std::string_view stored)
+{
+    char *block = const_cast<char *>(stored.data()) - sizeof(std::uint32_t);
+    std::uint32_t references;
+    std::memcpy(&references, block, sizeof(references));
+    references++;
+    std::memcpy(block, &references, sizeof(references));
+    return stored;
+}
+
+void KeyArena::release(std::string_view stored)
+{
+    char *block = const_cast<char *>(stored.data()) - sizeof(std::uint32_t);
+    std::uint32_t references;
+    std::memcpy(&references, block, sizeof(references));
+    if (--references > 0)
+    {
+        std::memcpy(block, &references, sizeof(references));
+        return;
+    }
+
+    size_t bytes = blockBytes(stored.size());
+    liveKeys--;
+    liveBytes -= bytes;
+    if (bytes > MaxPooledBytes)
+    {
+        largeBlocks.erase(std::lower_bound(largeBlocks.begin(), largeBlocks.end(), block, std::less<char *>()));
+        ::operator delete(block);
+        return;
+    }
+    std::memcpy(block, &freeLists[bytes / Granularity], sizeof(char *));
+    freeLists[bytes / Granularity] = block;
+}
+
+void KeyArena::releaseAll()
+{
+    for (char *chunk : chunks)
+        ::operator delete(chunk);
+    for (char *block : largeBlocks)
+        ::operator delete(block);
+    chunks.clear();
+    largeBlocks.clear();
+    std::fill(std::begin(freeLists), std::end(freeLists), nullptr);
+    bump = bumpEnd = nullptr;
+    liveKeys = liveBytes = 0;
+}
+
+// Record Implementation
+Record::Record(std::string_view k, int v, bool copyKey) : key(k), value(v), ownsKey(copyKey)
+{
+    if (!copyKey)
+        return;
+    char *bytes = new char[k.size()];
+    if (!k.empty())
+        std::memcpy(bytes, k.data(), k.size());
+    key = std::string_view(bytes, k.size());
+}
+
+Record::~Record()
+{
+    if (ownsKey)
+        delete[] key.data();
+}
+
+AVLNode::AVLNode(Record *r) : left(nullptr), right(nullptr), height(1), size(1)
+{
+    setRecord(r);
+}
+
+void AVLNode::setRecord(Record *r)
+{
+    record = r;
+    value = r->value;
+    size_t length = r->key.size();
+    keyLength = (std::uint8_t)std::min<size_t>(length, 255);
+    std::memset(keyPrefix, 0, sizeof(keyPrefix));
+    std::memcpy(keyPrefix, r->key.data(), std::min<size_t>(length, KeyPrefixBytes));
+}
+
+/*
+Same result as key.compare(record->key), but the record is only touched when both keys are longer than the
+inline prefix and agree on all of it
+*/
+int AVLNode::compareKey(std::string_view key) const
+{
+    size_t common;
+    return compareKeyFrom(key, 0, common);
+}
 
-AVLTree::AVLTree() : root(nullptr), nodeCount(0), searchComparisonCount(0) {}
+/*
+Like compareKey, but the first known bytes are already known to match and are skipped, and common is set to the
+length of the shared prefix so descents can carry it to the next level
+*/
+int AVLNode::compareKeyFrom(std::string_view key, size_t known, size_t &common) const
+{
+    size_t keyInline = std::min<size_t>(key.size(), KeyPrefixBytes);
+    size_t nodeInline = std::min<size_t>(keyLength, KeyPrefixBytes);
+    size_t limit = std::min(keyInline, nodeInline);
+    if (known < limit)
+    {
+        size_t at = mismatchFrom(key.data(), keyPrefix, limit, known);
+        if (at < limit)
+        {
+            common = at;
+            return (unsigned char)key[at] < (unsigned char)keyPrefix[at] ? -1 : 1;
+        }
+    }
+    common = limit;
+    if (keyInline != nodeInline)
+        return keyInline < nodeInline ? -1 : 1; // The shorter key ends inside the prefix, so it sorts first
+    if (keyInline < (size_t)KeyPrefixBytes)
+        return 0; // Both keys fit inline and match completely
+    if (keyLength <= KeyPrefixBytes || key.size() == (size_t)KeyPrefixBytes)
+        return key.size() == keyLength ? 0 : (key.size() < keyLength ? -1 : 1); // One side ends exactly at the prefix
+
+    std::string_view other = record->key;
+    size_t shorter = std::min(key.size(), other.size());
+    size_t at = mismatchFrom(key.data(), other.data(), shorter, std::max(known, (size_t)KeyPrefixBytes));
+    common = at;
+    if (at < shorter)
+        return (unsigned char)key[at] < (unsigned char)other[at] ? -1 : 1;
+    return key.size() == other.size() ? 0 : (key.size() < other.size() ? -1 : 1);
+}
+
+AVLTree::AVLTree(Ordering order)
+    : root(nullptr), nodeCount(0), ordering(order), pools(1, std::make_shared<SlabPool<AVLNode>>()) {}
 
 int AVLTree::height(AVLNode *node)
 {
     return node ? node->height : 0;
 }
 
+int AVLTree::size(const AVLNode *node)
+{
+    return node ? node->size : 0;
+}
+
+std::int64_t AVLTree::subtreeSum(const AVLNode *node)
+{
+    return node ? node->sum() : 0;
+}
+
+/*
+Refreshes every augmented field from the children, so every rotation and rebalance keeps subtree sizes and sums exact
+*/
 void AVLTree::updateHeight(AVLNode *node)
 {
     if (node)
     {
-        node->height = 1 + std::max(height(node->left), height(node->right));
+        node->height = (std::int8_t)(1 + std::max(height(node->left), height(node->right)));
+        node->size = 1 + size(node->left) + size(node->right);
+        if (ordering == Ordering::ByValue)
+            node->setSum(node->value + subtreeSum(node->left) + subtreeSum(node->right));
     }
 }
 
@@ -38,6 +437,7 @@ AVLNode *AVLTree::rotateRight(AVLNode *y)
     y->left = l->right; // the left child of y takes the place of y and y is moved as the right child of l. Since l's right child cannot be on the left of l, l->left is attached to the free hand of y instead.
     l->right = y;
     updateHeight(y), updateHeight(l); // Heights at node y and node l (which is the new root) are updated
+    OperationCounters::addRotation();
     return l;
 }
 
@@ -52,37 +452,94 @@ AVLNode *AVLTree::rotateLeft(AVLNode *x)
     x->right = r->left;
     r->left = x;
     updateHeight(x), updateHeight(r);
+    OperationCounters::addRotation();
     return r;
 }
 
-AVLNode *AVLTree::minValueNode(AVLNode *node)
+/*
+Three-way comparison of (key, value) against a record under this tree's ordering.
+Returns a negative number if (key, value) sorts before the record, positive if after and 0 on a match.
+*/
+int AVLTree::compare(std::string_view key, int value, const AVLNode *node) const
 {
-    while (node->left != nullptr)
+    if (ordering == Ordering::ByValue)
     {
-        node = node->left; // Finds the minimum value node
+        if (value != node->value)
+            return value < node->value ? -1 : 1;
+        return key.compare(node->record->key); // The prefix bytes hold the subtree sum here
     }
-    return node;
+    int cmp = node->compareKey(key);
+    if (cmp != 0)
+        return cmp;
+    return value < node->value ? -1 : (value > node->value ? 1 : 0);
+}
+
+/*
+compare() for descents. Every node below the last left turn and the last right turn lies between two bounds that
+share their first min(lcpLow, lcpHigh) key bytes with the search key, so those bytes never need to be compared again.
+Only the key ordering has that property; the value ordering compares normally and reports no shared prefix.
+*/
+int AVLTree::compareFrom(std::string_view key, int value, const AVLNode *node, size_t known, size_t &common) const
+{
+    if (ordering == Ordering::ByValue)
+    {
+        common = 0;
+        return compare(key, value, node);
+    }
+    int cmp = node->compareKeyFrom(key, known, common);
+    if (cmp != 0)
+        return cmp;
+    return value < node->value ? -1 : (value > node->value ? 1 : 0);
+}
+
+int AVLTree::compare(std::string_view key, int value, const Record *record) const
+{
+    if (ordering == Ordering::ByValue)
+    {
+        if (value != record->value)
+            return value < record->value ? -1 : 1; // value decides first, the key only breaks ties
+        return key.compare(record->key);
+    }
+    int cmp = key.compare(record->key);
+    if (cmp != 0)
+        return cmp;
+    return value < record->value ? -1 : (value > record->value ? 1 : 0); // Records sharing a key are kept as separate versions ordered by value
 }
 
-AVLNode *AVLTree::searchHelper(AVLNode *node, const std::string &key, int value) const
+AVLNode *AVLTree::searchHelper(AVLNode *node, std::string_view key, int value, OperationStats *stats) const
 {
     AVLNode *current = node;
+    int comparisons = 0;
+    size_t lcpLow = 0, lcpHigh = 0; // Key bytes shared with the nearest bounds on each side
     while (current)
     {
-        if (key < current->record->key)
+        size_t common;
+        int cmp = compareFrom(key, value, current, std::min(lcpLow, lcpHigh), common);
+        comparisons++; // Every node visited costs exactly one three-way comparison
+        if (cmp < 0)
         {
+            lcpHigh = common;
             current = current->left; // if the key is less than the current node's key, move to the left
         }
-        else if (key > current->record->key)
+        else if (cmp > 0)
         {
+            lcpLow = common;
             current = current->right; // if the key is greater than the current node's key, move to the right
         }
         else
         {
-            return current; // in this case, they key is equal to the current node's key, so we return the current node
+            break; // in this case, they key is equal to the current node's key, so we return the current node
         }
     }
-    return nullptr; // if the key is not found, return nullptr
+
+    OperationCounters::addComparisons(comparisons);
+    if (stats)
+    {
+        stats->comparisons = comparisons;
+        stats->depth = comparisons;
+        stats->rotations = 0;
+    }
+    return current; // if the key is not found, this is nullptr
 }
 
 AVLNode *AVLTree::reBalance(AVLNode *node)
@@ -119,214 +576,3715 @@ AVLNode *AVLTree::reBalance(AVLNode *node)
     return node; // if the balance is not greater than 1 or less than -1, return the node
 }
 
-AVLNode *AVLTree::insertHelper(AVLNode *node, Record *record)
+/*
+Walks back up a recorded descent path, rebalancing every ancestor from the deepest one to the root.
+Each entry is the link (root or a child pointer) that holds the ancestor, so rotations can replace it in place.
+*/
+void AVLTree::rebalancePath(AVLNode **path[], int depth)
 {
-    if (!node)
-        return new AVLNode(record); // In the correct position, the node is null, this is where the record is inserted
-
-    if (record->key < node->record->key)
+    while (depth > 0)
     {
-        node->left = insertHelper(node->left, record); // Recursion happens until the correct poistion is found
+        AVLNode **link = path[--depth];
+        *link = reBalance(*link);
     }
-    else if (record->key > node->record->key)
-    {
-        node->right = insertHelper(node->right, record); // In this case, inserthelper finds the position in the right subtree since the key is greater
-    }
-
-    updateHeight(node); // After every insertion, height is updated and the tree is rebalanced
-    return reBalance(node);
 }
 
-void AVLTree::insert(Record *record)
+bool AVLTree::insert(Record *record, OperationStats *stats)
 {
-    if (!root)
+    unsigned long long rotationsBefore = OperationCounters::threadRotations();
+    AVLNode **path[MaxHeight];
+    int depth = 0;
+    AVLNode **link = &root;
+    size_t lcpLow = 0, lcpHigh = 0;
+    while (*link)
+    {
+        size_t common;
+        int cmp = compareFrom(record->key, record->value, *link, std::min(lcpLow, lcpHigh), common);
+        if (cmp == 0)
+            break; // A matching record is already indexed, so the tree is left unchanged
+        path[depth++] = link;
+        (cmp < 0 ? lcpHigh : lcpLow) = common;
+        link = cmp < 0 ? &(*link)->left : &(*link)->right; // Descend once, remembering every link on the way down
+    }
+
+    bool inserted = !*link;
+    if (inserted)
     {
-        root = new AVLNode(record);
+        *link = createNode(record); // In the correct position, the link is null, this is where the record is inserted
         nodeCount++;
-        searchComparisonCount++;
-        return;
+        rebalancePath(path, depth); // After every insertion, each ancestor's height is updated and rebalanced bottom-up
+    }
+
+    int comparisons = inserted ? depth : depth + 1;
+    OperationCounters::addComparisons(comparisons);
+    if (stats)
+    {
+        stats->comparisons = comparisons;
+        stats->depth = depth + 1;
+        stats->rotations = (int)(OperationCounters::threadRotations() - rotationsBefore);
     }
-    root = insertHelper(root, record); // After inserting, node count is updated
-    nodeCount++;
+    return inserted;
 }
 
-void AVLTree::deleteNode(const std::string &key, int value)
+/*
+Returns the removed record (the tree never frees records) or nullptr if nothing matched
+*/
+Record *AVLTree::deleteNode(std::string_view key, int value, OperationStats *stats)
 {
-    if (!root)
-        return;
+    unsigned long long rotationsBefore = OperationCounters::threadRotations();
+    AVLNode **path[MaxHeight];
+    int depth = 0;
+    AVLNode **link = &root;
+    size_t lcpLow = 0, lcpHigh = 0;
+    while (*link)
+    {
+        size_t common;
+        int cmp = compareFrom(key, value, *link, std::min(lcpLow, lcpHigh), common);
+        if (cmp == 0)
+            break;
+        path[depth++] = link;
+        (cmp < 0 ? lcpHigh : lcpLow) = common;
+        link = cmp < 0 ? &(*link)->left : &(*link)->right;
+    }
 
-    AVLNode *nodeToDelete = searchHelper(root, key, value); // Node is found using searchHelper
-    if (!nodeToDelete || nodeToDelete->record->value != value)
+    AVLNode *nodeToDelete = *link;
+    int comparisons = nodeToDelete ? depth + 1 : depth;
+    OperationCounters::addComparisons(comparisons);
+    if (stats)
+    {
+        stats->comparisons = comparisons;
+        stats->depth = comparisons;
+        stats->rotations = 0;
+    }
+    if (!nodeToDelete)
     { // If no node matches the key and value, return
-        return;
+        return nullptr;
     }
+    Record *removed = nodeToDelete->record;
 
-    if (!nodeToDelete->left && !nodeToDelete->right)
+    if (!nodeToDelete->left || !nodeToDelete->right)
     {
-        if (nodeToDelete == root)
-        {
-            delete root; // Case 1: No children - Root deleted and set to nullptr
-            root = nullptr;
-        }
-        else
-        {
-            AVLNode *parent = deleteHelper(root, nodeToDelete); // Locate parent
-            if (parent->left == nodeToDelete)
-                parent->left = nullptr;
-            else
-                parent->right = nullptr;
-            delete nodeToDelete;
-        }
+        *link = nodeToDelete->left ? nodeToDelete->left : nodeToDelete->right; // Case 1/2: At most one child - whichever child exists (or null) takes its place
+        destroyNode(nodeToDelete);
     }
-    else if (!nodeToDelete->left || !nodeToDelete->right)
+    else
     {
-        AVLNode *child = nodeToDelete->left ? nodeToDelete->left : nodeToDelete->right; // Case 2: One child - whichever child exists is set to child
-
-        if (nodeToDelete == root)
-        {
-            root = child;
-        }
-        else
+        path[depth++] = link; // Case 3: Two children - keep descending to the in-order successor (minNode)
+        AVLNode **successor = &nodeToDelete->right;
+        while ((*successor)->left)
         {
-            AVLNode *parent = deleteHelper(root, nodeToDelete);
-            if (parent->left == nodeToDelete)
-                parent->left = child;
-            else
-                parent->right = child;
+            path[depth++] = successor;
+            successor = &(*successor)->left;
         }
-        delete nodeToDelete; // node is deleted and its parent is set to the child
-    }
-    else
-    {
-        AVLNode *minNode = minValueNode(nodeToDelete->right); // Case 3: Two children - Find the in-order successor (minNode)
-        nodeToDelete->record = minNode->record;
+        AVLNode *minNode = *successor;
+        nodeToDelete->setRecord(minNode->record);
 
-        AVLNode *parent = deleteHelper(root, minNode); // Delete the in-order successor (minNode)
-        if (parent->left == minNode)
-            parent->left = minNode->right;
-        else
-            parent->right = minNode->right;
-        delete minNode;
+        *successor = minNode->right; // Unlink the in-order successor in place of the node itself
+        destroyNode(minNode);
     }
 
-    updateHeight(root); // After each deletion, height is updated and the tree is rebalanced
-    root = reBalance(root);
-
     nodeCount--; // After each deletion, node count is updated
+    rebalancePath(path, depth); // Every ancestor on the path is rebalanced, not just the root
+    if (stats)
+        stats->rotations = (int)(OperationCounters::threadRotations() - rotationsBefore);
+    return removed;
 }
 
-AVLNode *AVLTree::deleteHelper(AVLNode *root, AVLNode *child) const
-{
-    AVLNode *parent = nullptr;
-    AVLNode *current = root; // The function finds the parent of the node to be deleted
-
-    while (current && current != child)
-    {
-        parent = current;
-        if (child->record->key < current->record->key)
-            current = current->left; // if the key is less than the current node's key, move to the left
-        else
-            current = current->right; // if the key is greater than the current node's key, move to the right
-    }
-    return parent;
-}
-
-Record *AVLTree::search(const std::string &key, int value)
+/*
+Drops every node in one step by releasing the node slabs, records are left to the caller.
+A pool another tree still holds nodes in is left to that tree and replaced by a fresh one.
+*/
+void AVLTree::reset()
 {
-
-    AVLNode *found = searchHelper(root, key, value);
-
-    if (!found)
-    {
-        Record record = Record("", 0);
-        AVLNode *node = new AVLNode(&record);           //If the key is not found, a node with key "" and value 0 is returned
-        found = node;
-    }
-    return found->record;
+    root = nullptr;
+    nodeCount = 0;
+    pools.resize(1);
+    if (pools[0].use_count() == 1)
+        pools[0]->releaseAll();
+    else
+        pools[0] = std::make_shared<SlabPool<AVLNode>>();
 }
 
-// IndexedDatabase Implementation
-void IndexedDatabase::insert(Record *record)
+/*
+Only pools[0] is ever written by this tree, so nodes that came from an adopted pool are simply abandoned:
+their slots are reclaimed when the last tree holding that pool lets go of it
+*/
+void AVLTree::destroyNode(AVLNode *node)
 {
-    index.insert(record);
+    if (pools.size() == 1 || pools[0]->owns(node))
+        pools[0]->destroy(node);
 }
 
-Record *IndexedDatabase::search(const std::string &key, int value)
+/*
+Empties the tree and hands its nodes to the caller: the old root is returned and kept receives every pool
+they may live in, so the memory stays valid after the reset
+*/
+AVLNode *AVLTree::release(std::vector<std::shared_ptr<SlabPool<AVLNode>>> &kept)
 {
-    return index.search(key, value);
+    AVLNode *oldRoot = root;
+    kept.insert(kept.end(), pools.begin(), pools.end());
+    reset();
+    return oldRoot;
 }
 
-void IndexedDatabase::deleteRecord(const std::string &key, int value)
+void AVLTree::adoptPools(const std::vector<std::shared_ptr<SlabPool<AVLNode>>> &adopted)
 {
-    index.deleteNode(key, value);
+    for (const auto &pool : adopted)
+        if (std::find(pools.begin(), pools.end(), pool) == pools.end())
+            pools.push_back(pool);
 }
 
-/* RangeQuery Hints
-1. Base: if (!node) return
-2. Key Traversal Logic:
-   - If value >= start: check left subtree
-   - If start <= value <= end: add to result
-   - If value <= end: check right subtree
+/*
+Links nodes[0..count) (already in tree order) into a perfectly balanced subtree and returns its root.
+The top parallelDepth levels hand their left half to another thread, since the two halves share no nodes.
 */
-
-void IndexedDatabase::rangeQueryHelper(AVLNode *node, int start, int end, std::vector<Record *> &result) const
+AVLNode *AVLTree::buildBalanced(AVLNode **nodes, int count, int parallelDepth)
 {
-    if (!node)
-        return;
-
-    if (node->record->value > start)
-    {
-        rangeQueryHelper(node->left, start, end, result);       //If value greater than start, check left subtree
-    }
+    if (count <= 0)
+        return nullptr;
 
-    if (node->record->value >= start && node->record->value <= end)
+    int mid = count / 2; // Middle node becomes the root so both halves differ in size by at most one
+    AVLNode *node = nodes[mid];
+    if (parallelDepth > 0 && count >= ParallelBuildThreshold)
     {
-        result.push_back(node->record);                         //If value is between start and end, add to result
+        auto left = std::async(std::launch::async, &AVLTree::buildBalanced, this, nodes, mid, parallelDepth - 1);
+        node->right = buildBalanced(nodes + mid + 1, count - mid - 1, parallelDepth - 1);
+        node->left = left.get();
     }
-
-    if (node->record->value < end)
+    else
     {
-        rangeQueryHelper(node->right, start, end, result);              //If value less than end, check right subtree
+        node->left = buildBalanced(nodes, mid, 0);
+        node->right = buildBalanced(nodes + mid + 1, count - mid - 1, 0);
     }
+    updateHeight(node);
+    return node;
 }
 
-std::vector<Record *> IndexedDatabase::rangeQuery(int start, int end)
+/*
+Replaces the tree with one built bottom-up from records sorted (and free of duplicates) under this tree's ordering.
+Runs in O(n) with no rotations, nodes are allocated up front so the parallel build never touches the pool.
+*/
+void AVLTree::buildFromSorted(const std::vector<Record *> &sorted, bool parallel)
 {
-    std::vector<Record *> result;
-    rangeQueryHelper(index.root, start, end, result);               
-    return result;
-}
+    reset();
 
-void IndexedDatabase::clearHelper(AVLNode *node)
-{
-    if (!node)
-        return;
-    clearHelper(node->left);
-    clearHelper(node->right);
-    delete node->record;
-    delete node;
+    std::vector<AVLNode *> nodes;
+    nodes.reserve(sorted.size());
+    for (Record *record : sorted)
+        nodes.push_back(createNode(record));
+
+    root = buildBalanced(nodes.data(), (int)nodes.size(), parallelDepthFor(parallel));
+    nodeCount = (int)nodes.size();
 }
 
-void IndexedDatabase::clearDatabase()
+/*
+Links left, pivot and right (every key in left < pivot < every key in right) into one AVL tree.
+The shorter side is hung off the spine of the taller one at the matching height and the path back up is rebalanced,
+so the cost is O(|height(left) - height(right)| + 1).
+*/
+AVLNode *AVLTree::join(AVLNode *left, AVLNode *pivot, AVLNode *right)
 {
-    clearHelper(index.root);
-    index.root = nullptr;
+    if (height(left) > height(right) + 1)
+        return joinRight(left, pivot, right);
+    if (height(right) > height(left) + 1)
+        return joinLeft(left, pivot, right);
+    pivot->left = left;
+    pivot->right = right;
+    updateHeight(pivot);
+    return pivot;
 }
 
-int IndexedDatabase::calculateHeight(AVLNode *node) const
+AVLNode *AVLTree::joinRight(AVLNode *left, AVLNode *pivot, AVLNode *right)
 {
-    if (!node)
-        return 0;
-    return 1 + std::max(calculateHeight(node->left), calculateHeight(node->right));
+    if (height(left) <= height(right) + 1)
+    {
+        pivot->left = left;
+        pivot->right = right;
+        updateHeight(pivot);
+        return pivot;
+    }
+    left->right = joinRight(left->right, pivot, right); // Grows by at most one level, like an insert
+    return reBalance(left);
 }
 
-int IndexedDatabase::getTreeHeight() const
+AVLNode *AVLTree::joinLeft(AVLNode *left, AVLNode *pivot, AVLNode *right)
 {
-    return calculateHeight(index.root);
+    if (height(right) <= height(left) + 1)
+    {
+        pivot->left = left;
+        pivot->right = right;
+        updateHeight(pivot);
+        return pivot;
+    }
+    right->left = joinLeft(left, pivot, right->left);
+    return reBalance(right);
 }
 
-int IndexedDatabase::getSearchComparisons(const std::string &key, int value)
+/*
+Detaches the smallest node of a non-empty subtree into min and returns the rebalanced rest
+*/
+AVLNode *AVLTree::removeMin(AVLNode *node, AVLNode *&min)
 {
-    search(key, value);
-    return index.getLastSearchComparisons();
+    if (!node->left)
+    {
+        min = node;
+        return node->right;
+    }
+    node->left = removeMin(node->left, min);
+    return reBalance(node);
+}
+
+/*
+join() without a pivot: the smallest node of right takes that role
+*/
+AVLNode *AVLTree::join2(AVLNode *left, AVLNode *right)
+{
+    if (!right)
+        return left;
+    AVLNode *min;
+    AVLNode *rest = removeMin(right, min);
+    return join(left, min, rest);
+}
+
+/*
+Splits a subtree around (key, value): less and greater receive the nodes on either side as valid AVL trees, and match
+the node equal to it (detached) or nullptr. Each level joins the part it leaves behind, O(log n) overall.
+*/
+void AVLTree::split(AVLNode *node, std::string_view key, int value, AVLNode *&less, AVLNode *&match, AVLNode *&greater)
+{
+    if (!node)
+    {
+        less = match = greater = nullptr;
+        return;
+    }
+    int cmp = compare(key, value, node);
+    if (cmp == 0)
+    {
+        less = node->left;
+        greater = node->right;
+        node->left = node->right = nullptr;
+        node->height = 1;
+        node->size = 1;
+        if (ordering == Ordering::ByValue)
+            node->setSum(node->value);
+        match = node;
+    }
+    else if (cmp < 0)
+    {
+        AVLNode *inner;
+        split(node->left, key, value, less, match, inner);
+        greater = join(inner, node, node->right);
+    }
+    else
+    {
+        AVLNode *inner;
+        split(node->right, key, value, inner, match, greater);
+        less = join(node->left, node, inner);
+    }
+}
+
+/*
+Merges nodes[0..count) (sorted under this tree's ordering, no repeats) into tree. The middle node splits the tree,
+each half is merged with its own half of the batch, and the pieces are joined back around it, which is
+O(m log(n/m + 1)) for a batch of m. New nodes whose record is already present are left out and go to rejected.
+*/
+AVLNode *AVLTree::unionSorted(AVLNode *tree, AVLNode **nodes, int count, std::vector<AVLNode *> &rejected)
+{
+    if (count == 0)
+        return tree;
+    if (!tree)
+        return buildBalanced(nodes, count, 0); // Nothing left to merge with, so the batch slice is linked directly
+
+    int mid = count / 2;
+    AVLNode *less, *match, *greater;
+    split(tree, nodes[mid]->record->key, nodes[mid]->record->value, less, match, greater);
+    AVLNode *left = unionSorted(less, nodes, mid, rejected);
+    if (match)
+        rejected.push_back(nodes[mid]); // Pushed between the two halves, so rejected stays sorted
+    AVLNode *right = unionSorted(greater, nodes + mid + 1, count - mid - 1, rejected);
+    return join(left, match ? match : nodes[mid], right);
+}
+
+/*
+Removes every node matching one of items[0..count) (sorted under this tree's ordering) and collects it in removed.
+Same divide and conquer as unionSorted, with join2 closing the gap a removed node leaves.
+*/
+template <typename Item>
+AVLNode *AVLTree::differenceSorted(AVLNode *tree, Item *const *items, int count, std::vector<AVLNode *> &removed)
+{
+    if (count == 0 || !tree)
+        return tree;
+
+    int mid = count / 2;
+    AVLNode *less, *match, *greater;
+    split(tree, items[mid]->key, items[mid]->value, less, match, greater);
+    AVLNode *left = differenceSorted(less, items, mid, removed);
+    if (match)
+        removed.push_back(match);
+    AVLNode *right = differenceSorted(greater, items + mid + 1, count - mid - 1, removed);
+    return join2(left, right);
+}
+
+/*
+Adds records sorted under this tree's ordering in one merge and returns how many were added.
+Records that were already present are not linked and are appended to rejected, in order.
+*/
+int AVLTree::insertSorted(const std::vector<Record *> &sorted, std::vector<Record *> &rejected)
+{
+    std::vector<AVLNode *> nodes;
+    nodes.reserve(sorted.size());
+    for (Record *record : sorted)
+        nodes.push_back(createNode(record));
+
+    std::vector<AVLNode *> duplicates;
+    root = unionSorted(root, nodes.data(), (int)nodes.size(), duplicates);
+    for (AVLNode *node : duplicates)
+    {
+        rejected.push_back(node->record);
+        destroyNode(node);
+    }
+    int added = (int)(nodes.size() - duplicates.size());
+    nodeCount += added;
+    return added;
+}
+
+/*
+Removes the (key, value) of every item, sorted under this tree's ordering, in one merge.
+The records that were unlinked are appended to removed.
+*/
+template <typename Item>
+void AVLTree::eraseSorted(const std::vector<Item *> &sorted, std::vector<Record *> &removed)
+{
+    std::vector<AVLNode *> unlinked;
+    root = differenceSorted(root, sorted.data(), (int)sorted.size(), unlinked);
+    for (AVLNode *node : unlinked)
+    {
+        removed.push_back(node->record);
+        destroyNode(node);
+    }
+    nodeCount -= (int)unlinked.size();
+}
+
+void AVLTree::collectNodes(AVLNode *node, std::vector<AVLNode *> &nodes) const
+{
+    if (!node)
+        return;
+    collectNodes(node->left, nodes);
+    nodes.push_back(node);
+    collectNodes(node->right, nodes);
+}
+
+/*
+Rebuilds the tree as left, then pivot, then right in O(log n); every record in left must order before pivot and
+every record in right after it. Either side may be this tree itself.
+*/
+void AVLTree::join(AVLTree &left, Record *pivot, AVLTree &right)
+{
+    int count = left.nodeCount + right.nodeCount + 1;
+    std::vector<std::shared_ptr<SlabPool<AVLNode>>> kept;
+    AVLNode *low = left.release(kept);
+    AVLNode *high = right.release(kept);
+    reset();
+    adoptPools(kept);
+    root = join(low, createNode(pivot), high);
+    nodeCount = count;
+}
+
+/*
+Keeps the records ordered before (key, value) and moves the rest into upper, replacing whatever upper held. O(log n).
+*/
+void AVLTree::split(std::string_view key, int value, AVLTree &upper)
+{
+    upper.reset();
+    AVLNode *less, *match, *greater;
+    split(root, key, value, less, match, greater);
+    if (match)
+        greater = join(nullptr, match, greater); // The matching record starts the upper part
+
+    root = less;
+    nodeCount = size(less);
+    upper.adoptPools(pools);
+    upper.root = greater;
+    upper.nodeCount = size(greater);
+}
+
+/*
+Union by split and join: the other tree's root splits this tree, the two halves are merged with its subtrees
+independently (on separate threads near the top when parallel), and the results are joined around it.
+O(m log(n/m + 1)) for trees of m <= n nodes. Where both trees hold a record, this tree's node is kept.
+*/
+AVLNode *AVLTree::unionTrees(AVLNode *tree, AVLNode *other, int parallelDepth, std::vector<AVLNode *> &dropped)
+{
+    if (!tree)
+        return other;
+    if (!other)
+        return tree;
+
+    AVLNode *less, *match, *greater;
+    AVLNode *otherLeft = other->left, *otherRight = other->right;
+    split(tree, other->record->key, other->record->value, less, match, greater);
+    AVLNode *left, *right;
+    if (parallelDepth > 0 && other->height >= ParallelSetHeight)
+    {
+        std::vector<AVLNode *> droppedLeft;
+        auto task = std::async(std::launch::async, [&]()
+                               { return unionTrees(less, otherLeft, parallelDepth - 1, droppedLeft); });
+        right = unionTrees(greater, otherRight, parallelDepth - 1, dropped);
+        left = task.get();
+        dropped.insert(dropped.end(), droppedLeft.begin(), droppedLeft.end());
+    }
+    else
+    {
+        left = unionTrees(less, otherLeft, 0, dropped);
+        right = unionTrees(greater, otherRight, 0, dropped);
+    }
+    if (match)
+        dropped.push_back(other);
+    return join(left, match ? match : other, right);
+}
+
+AVLNode *AVLTree::intersectTrees(AVLNode *tree, const AVLNode *other, int parallelDepth, std::vector<AVLNode *> &dropped)
+{
+    if (!tree)
+        return nullptr;
+    if (!other)
+    {
+        collectNodes(tree, dropped);
+        return nullptr;
+    }
+
+    AVLNode *less, *match, *greater;
+    split(tree, other->record->key, other->record->value, less, match, greater);
+    AVLNode *left, *right;
+    if (parallelDepth > 0 && other->height >= ParallelSetHeight)
+    {
+        std::vector<AVLNode *> droppedLeft;
+        auto task = std::async(std::launch::async, [&]()
+                               { return intersectTrees(less, other->left, parallelDepth - 1, droppedLeft); });
+        right = intersectTrees(greater, other->right, parallelDepth - 1, dropped);
+        left = task.get();
+        dropped.insert(dropped.end(), droppedLeft.begin(), droppedLeft.end());
+    }
+    else
+    {
+        left = intersectTrees(less, other->left, 0, dropped);
+        right = intersectTrees(greater, other->right, 0, dropped);
+    }
+    return match ? join(left, match, right) : join2(left, right);
+}
+
+AVLNode *AVLTree::differenceTrees(AVLNode *tree, const AVLNode *other, int parallelDepth, std::vector<AVLNode *> &dropped)
+{
+    if (!tree || !other)
+        return tree;
+
+    AVLNode *less, *match, *greater;
+    split(tree, other->record->key, other->record->value, less, match, greater);
+    AVLNode *left, *right;
+    if (parallelDepth > 0 && other->height >= ParallelSetHeight)
+    {
+        std::vector<AVLNode *> droppedLeft;
+        auto task = std::async(std::launch::async, [&]()
+                               { return differenceTrees(less, other->left, parallelDepth - 1, droppedLeft); });
+        right = differenceTrees(greater, other->right, parallelDepth - 1, dropped);
+        left = task.get();
+        dropped.insert(dropped.end(), droppedLeft.begin(), droppedLeft.end());
+    }
+    else
+    {
+        left = differenceTrees(less, other->left, 0, dropped);
+        right = differenceTrees(greater, other->right, 0, dropped);
+    }
+    if (match)
+        dropped.push_back(match);
+    return join2(left, right);
+}
+
+/*
+Moves every node of other into this tree and leaves other empty.
+Returns other's records that were already present here; their nodes are dropped and the records left to the caller.
+*/
+std::vector<Record *> AVLTree::unionWith(AVLTree &other, bool parallel)
+{
+    std::vector<Record *> duplicates;
+    if (&other == this)
+        return duplicates;
+    int otherCount = other.nodeCount;
+    std::vector<std::shared_ptr<SlabPool<AVLNode>>> kept;
+    AVLNode *otherRoot = other.release(kept);
+    adoptPools(kept);
+
+    std::vector<AVLNode *> dropped;
+    root = unionTrees(root, otherRoot, parallelDepthFor(parallel), dropped);
+    nodeCount += otherCount - (int)dropped.size();
+    for (AVLNode *node : dropped)
+    {
+        duplicates.push_back(node->record);
+        destroyNode(node);
+    }
+    return duplicates;
+}
+
+/*
+Keeps only the records other also holds and returns the ones removed. other is only read.
+*/
+std::vector<Record *> AVLTree::intersect(const AVLTree &other, bool parallel)
+{
+    std::vector<Record *> removed;
+    if (&other == this)
+        return removed;
+    std::vector<AVLNode *> dropped;
+    root = intersectTrees(root, other.root, parallelDepthFor(parallel), dropped);
+    nodeCount -= (int)dropped.size();
+    for (AVLNode *node : dropped)
+    {
+        removed.push_back(node->record);
+        destroyNode(node);
+    }
+    return removed;
+}
+
+/*
+Removes the records other also holds and returns them. other is only read.
+*/
+std::vector<Record *> AVLTree::difference(const AVLTree &other, bool parallel)
+{
+    std::vector<Record *> removed;
+    std::vector<AVLNode *> dropped;
+    if (&other == this)
+    {
+        collectNodes(root, dropped);
+        root = nullptr;
+    }
+    else
+        root = differenceTrees(root, other.root, parallelDepthFor(parallel), dropped);
+    nodeCount -= (int)dropped.size();
+    for (AVLNode *node : dropped)
+    {
+        removed.push_back(node->record);
+        destroyNode(node);
+    }
+    return removed;
+}
+
+/*
+Never allocates: a miss returns a shared, empty sentinel record (key "" and value 0) that callers must not modify.
+Use find() to get nullptr on a miss instead.
+*/
+Record *AVLTree::search(std::string_view key, int value, OperationStats *stats)
+{
+    static Record notFound("", 0);
+
+    Record *found = find(key, value, stats);
+    return found ? found : &notFound;
+}
+
+Record *AVLTree::find(std::string_view key, int value, OperationStats *stats) const
+{
+    AVLNode *found = searchHelper(root, key, value, stats);
+    return found ? found->record : nullptr;
+}
+
+/*
+Looks up count queries by advancing up to BatchWidth descents in turn, one level each per round. The child each lane
+moves to is prefetched before the other lanes are compared, so the cache misses of different lookups overlap
+instead of being paid one after another. Misses leave nullptr in results.
+*/
+void AVLTree::findBatch(const std::pair<std::string, int> *queries, size_t count, Record **results) const
+{
+    struct Lane
+    {
+        const std::pair<std::string, int> *query;
+        AVLNode *current;
+        size_t lcpLow, lcpHigh;
+        Record **result;
+    };
+    Lane lanes[BatchWidth];
+    int comparisons = 0;
+
+    for (size_t first = 0; first < count; first += BatchWidth)
+    {
+        int active = (int)std::min<size_t>(BatchWidth, count - first);
+        for (int i = 0; i < active; i++)
+            lanes[i] = Lane{&queries[first + i], root, 0, 0, &results[first + i]};
+
+        while (active > 0)
+        {
+            for (int i = 0; i < active;)
+            {
+                Lane &lane = lanes[i];
+                if (!lane.current)
+                {
+                    *lane.result = nullptr;
+                    lane = lanes[--active]; // Finished lanes are swapped out so the round only visits live ones
+                    continue;
+                }
+                size_t common;
+                int cmp = compareFrom(lane.query->first, lane.query->second, lane.current,
+                                      std::min(lane.lcpLow, lane.lcpHigh), common);
+                comparisons++;
+                if (cmp == 0)
+                {
+                    *lane.result = lane.current->record;
+                    lane = lanes[--active];
+                    continue;
+                }
+                if (cmp < 0)
+                    lane.lcpHigh = common, lane.current = lane.current->left;
+                else
+                    lane.lcpLow = common, lane.current = lane.current->right;
+                if (lane.current)
+                    __builtin_prefetch(lane.current);
+                i++;
+            }
+        }
+    }
+    OperationCounters::addComparisons(comparisons);
+}
+
+/*
+Number of records ordered before (key, value), plus a matching record when inclusive.
+Each step right skips the whole left subtree by its size, so this is one O(log n) descent.
+*/
+int AVLTree::countBefore(std::string_view key, int value, bool inclusive) const
+{
+    int before = 0;
+    for (AVLNode *node = root; node;)
+    {
+        int cmp = compare(key, value, node);
+        if (cmp < 0 || (cmp == 0 && !inclusive))
+            node = node->left;
+        else
+        {
+            before += size(node->left) + 1;
+            node = node->right;
+        }
+    }
+    return before;
+}
+
+std::int64_t AVLTree::sumBefore(std::string_view key, int value, bool inclusive) const
+{
+    std::int64_t before = 0;
+    for (AVLNode *node = root; node;)
+    {
+        int cmp = compare(key, value, node);
+        if (cmp < 0 || (cmp == 0 && !inclusive))
+            node = node->left;
+        else
+        {
+            before += subtreeSum(node->left) + node->value;
+            node = node->right;
+        }
+    }
+    return before;
+}
+
+int AVLTree::rank(std::string_view key, int value) const
+{
+    return countBefore(key, value, false);
+}
+
+/*
+Visits the records ranked [from, to) within node's subtree, skipping whole subtrees by their sizes, so a slice of k
+records costs O(log n + k). Recurses only into left children, which at most MaxHeight levels can stack.
+*/
+template <typename Visit>
+void AVLTree::forEachRank(const AVLNode *node, int from, int to, Visit &visit)
+{
+    while (node && from < to)
+    {
+        int leftSize = size(node->left);
+        if (from < leftSize)
+            forEachRank(node->left, from, std::min(to, leftSize), visit);
+        if (from <= leftSize && leftSize < to)
+            visit(node->record);
+        from = std::max(from - leftSize - 1, 0);
+        to -= leftSize + 1;
+        node = node->right;
+    }
+}
+
+/*
+With samples below the node count, the nodes at evenly spaced ranks stand in for the tree: the ranks pick nodes
+uniformly, so their mean depth and balance mix estimate the whole tree's without visiting it
+*/
+TreeShape AVLTree::shape(int samples) const
+{
+    TreeShape shape;
+    shape.height = getHeight();
+    if (!root)
+        return shape;
+    double depthTotal = 0;
+    auto measure = [&](const AVLNode *node, int depth)
+    {
+        int factor = (node->left ? node->left->height : 0) - (node->right ? node->right->height : 0);
+        shape.balance[std::min(std::max(factor, -1), 1) + 1]++;
+        depthTotal += depth;
+        shape.sampled++;
+    };
+
+    if (samples <= 0 || samples >= nodeCount)
+    {
+        std::pair<const AVLNode *, int> stack[2 * MaxHeight];
+        int top = 0;
+        stack[top++] = {root, 1};
+        while (top > 0)
+        {
+            auto [node, depth] = stack[--top];
+            measure(node, depth);
+            if (node->left)
+                stack[top++] = {node->left, depth + 1};
+            if (node->right)
+                stack[top++] = {node->right, depth + 1};
+        }
+    }
+    else
+    {
+        for (int i = 0; i < samples; i++)
+        {
+            int rank = (int)(((2LL * i + 1) * nodeCount) / (2LL * samples)); // Middle of the i-th of samples equal slices
+            const AVLNode *node = root;
+            int depth = 1;
+            while (rank != size(node->left))
+            {
+                if (rank < size(node->left))
+                    node = node->left;
+                else
+                {
+                    rank -= size(node->left) + 1;
+                    node = node->right;
+                }
+                depth++;
+            }
+            measure(node, depth);
+        }
+    }
+    shape.averageDepth = depthTotal / shape.sampled;
+    return shape;
+}
+
+std::size_t AVLTree::slabBytes() const
+{
+    std::size_t bytes = 0;
+    for (const auto &pool : pools)
+        bytes += pool->capacity() * sizeof(AVLNode);
+    return bytes;
+}
+
+/*
+The record at 0-based position i in the tree's order, or nullptr when i is out of range
+*/
+Record *AVLTree::select(int i) const
+{
+    if (i < 0 || i >= nodeCount)
+        return nullptr;
+    AVLNode *node = root;
+    while (node)
+    {
+        int leftSize = size(node->left);
+        if (i < leftSize)
+            node = node->left;
+        else if (i == leftSize)
+            return node->record;
+        else
+        {
+            i -= leftSize + 1;
+            node = node->right;
+        }
+    }
+    return nullptr;
+}
+
+/*
+Records from (lowKey, lowValue) through (highKey, highValue) inclusive, as two rank descents
+*/
+int AVLTree::countRange(std::string_view lowKey, int lowValue, std::string_view highKey, int highValue) const
+{
+    return std::max(0, countBefore(highKey, highValue, true) - countBefore(lowKey, lowValue, false));
+}
+
+// AVLCursor Implementation
+void AVLCursor::seekFirst()
+{
+    depth = 0;
+    for (AVLNode *node = tree->root; node; node = node->left)
+        path[depth++] = node;
+}
+
+void AVLCursor::seekLast()
+{
+    depth = 0;
+    for (AVLNode *node = tree->root; node; node = node->right)
+        path[depth++] = node;
+}
+
+void AVLCursor::seek(std::string_view key, int value)
+{
+    depth = 0;
+    int found = 0; // Path length up to the last node that was >= the target
+    for (AVLNode *node = tree->root; node;)
+    {
+        path[depth++] = node;
+        if (tree->compare(key, value, node) <= 0)
+        {
+            found = depth;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    depth = found; // Trimming the path back to that node leaves exactly its ancestors on the stack
+}
+
+void AVLCursor::next()
+{
+    if (depth == 0)
+        return;
+
+    AVLNode *node = path[depth - 1];
+    if (node->right)
+    {
+        for (node = node->right; node; node = node->left)
+            path[depth++] = node; // Successor is the leftmost node of the right subtree
+        return;
+    }
+
+    AVLNode *child;
+    do
+    {
+        child = path[--depth]; // Otherwise climb until we leave a left subtree
+    } while (depth > 0 && path[depth - 1]->right == child);
+}
+
+void AVLCursor::prev()
+{
+    if (depth == 0)
+        return;
+
+    AVLNode *node = path[depth - 1];
+    if (node->left)
+    {
+        for (node = node->left; node; node = node->right)
+            path[depth++] = node; // Predecessor is the rightmost node of the left subtree
+        return;
+    }
+
+    AVLNode *child;
+    do
+    {
+        child = path[--depth];
+    } while (depth > 0 && path[depth - 1]->left == child);
+}
+
+// FrozenIndex Implementation
+FrozenIndex::FrozenIndex(const std::vector<Record *> &sorted)
+    : entries(sorted.size() + 1), records(sorted.size() + 1, nullptr), liveCount((int)sorted.size())
+{
+    size_t bytes = 0;
+    for (const Record *record : sorted)
+        bytes += record->key.size();
+    keyBytes.reserve(bytes);
+
+    size_t next = 0;
+    layout(sorted, next, 1);
+}
+
+/*
+An in-order walk of the implicit tree hands out the sorted records, which places them in breadth-first order
+*/
+void FrozenIndex::layout(const std::vector<Record *> &sorted, size_t &next, size_t slot)
+{
+    if (slot >= entries.size())
+        return;
+    layout(sorted, next, 2 * slot);
+
+    Record *record = sorted[next++];
+    Entry &entry = entries[slot];
+    std::memset(entry.keyPrefix, 0, sizeof(entry.keyPrefix));
+    std::memcpy(entry.keyPrefix, record->key.data(), std::min<size_t>(record->key.size(), KeyPrefixBytes));
+    entry.keyLength = (std::uint32_t)record->key.size();
+    entry.keyOffset = (std::uint32_t)keyBytes.size();
+    entry.value = record->value;
+    keyBytes.insert(keyBytes.end(), record->key.begin(), record->key.end());
+    records[slot] = record;
+
+    layout(sorted, next, 2 * slot + 1);
+}
+
+int FrozenIndex::compare(std::string_view key, int value, const Entry &entry) const
+{
+    int cmp = comparePrefixed(key, entry.keyPrefix, KeyPrefixBytes, entry.keyLength, [&]()
+                              { return std::string_view(keyBytes.data() + entry.keyOffset, entry.keyLength); });
+    if (cmp != 0)
+        return cmp;
+    return value < entry.value ? -1 : (value > entry.value ? 1 : 0);
+}
+
+/*
+Branch-free lower-bound descent: every level moves to 2k + (target > entry), and the four grandchildren (contiguous,
+128 bytes) are prefetched while the current entry is compared. Stripping the trailing right turns at the end
+recovers the lower-bound slot, which is checked once for equality.
+*/
+Record *FrozenIndex::find(std::string_view key, int value, OperationStats *stats) const
+{
+    size_t count = entries.size() - 1;
+    size_t slot = 1;
+    int comparisons = 0;
+    while (slot <= count)
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch(&entries[0] + std::min(4 * slot, count));
+#endif
+        slot = 2 * slot + (compare(key, value, entries[slot]) > 0);
+        comparisons++;
+    }
+    slot >>= __builtin_ffsll((long long)~slot); // Undo the right turns taken after the last left turn
+
+    Record *found = nullptr;
+    if (slot != 0)
+    {
+        comparisons++;
+        if (compare(key, value, entries[slot]) == 0)
+            found = records[slot];
+    }
+
+    OperationCounters::addComparisons(comparisons);
+    if (stats)
+    {
+        stats->comparisons = comparisons;
+        stats->depth = comparisons;
+        stats->rotations = 0;
+    }
+    return found;
+}
+
+bool FrozenIndex::erase(std::string_view key, int value)
+{
+    size_t count = entries.size() - 1;
+    size_t slot = 1;
+    while (slot <= count)
+    {
+        int cmp = compare(key, value, entries[slot]);
+        if (cmp == 0)
+        {
+            if (!records[slot])
+                return false;
+            records[slot] = nullptr;
+            liveCount--;
+            return true;
+        }
+        slot = 2 * slot + (cmp > 0);
+    }
+    return false;
+}
+
+// HashIndex Implementation
+HashIndex::HashIndex(std::size_t expected) : count(0), mask(0)
+{
+    reserve(expected);
+}
+
+/*
+The standard string hash, with the value folded in and a splitmix64 finalizer so low bits are well mixed for the mask
+*/
+std::uint64_t HashIndex::hashOf(std::string_view key, int value)
+{
+    std::uint64_t hash = std::hash<std::string_view>()(key);
+    hash ^= (std::uint64_t)(std::uint32_t)value * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+void HashIndex::rehash(std::size_t capacity)
+{
+    std::vector<Slot> old(capacity, Slot{0, nullptr});
+    old.swap(slots);
+    mask = capacity - 1;
+    for (const Slot &slot : old)
+    {
+        if (!slot.record)
+            continue;
+        std::size_t i = slot.hash & mask;
+        while (slots[i].record)
+            i = (i + 1) & mask;
+        slots[i] = slot;
+    }
+}
+
+/*
+Grows (never shrinks) to a power of two that keeps expected records under the 3/4 load limit
+*/
+void HashIndex::reserve(std::size_t expected)
+{
+    std::size_t capacity = 16;
+    while (capacity * 3 < expected * 4)
+        capacity *= 2;
+    if (capacity > slots.size())
+        rehash(capacity);
+}
+
+bool HashIndex::insert(Record *record)
+{
+    reserve(count + 1);
+    std::uint64_t hash = hashOf(record->key, record->value);
+    std::size_t i = hash & mask;
+    while (slots[i].record)
+    {
+        if (slots[i].hash == hash && slots[i].record->value == record->value && slots[i].record->key == record->key)
+            return false;
+        i = (i + 1) & mask;
+    }
+    slots[i] = Slot{hash, record};
+    count++;
+    return true;
+}
+
+Record *HashIndex::find(std::string_view key, int value, OperationStats *stats) const
+{
+    std::uint64_t hash = hashOf(key, value);
+    int probes = 0;
+    Record *found = nullptr;
+    for (std::size_t i = hash & mask; slots[i].record; i = (i + 1) & mask)
+    {
+        probes++;
+        if (slots[i].hash == hash && slots[i].record->value == value && slots[i].record->key == key)
+        {
+            found = slots[i].record;
+            break;
+        }
+    }
+    if (stats)
+    {
+        stats->comparisons = probes; // Slots inspected, the key itself is only compared once the hashes agree
+        stats->depth = 0;
+        stats->rotations = 0;
+    }
+    return found;
+}
+
+/*
+Hashes the whole batch and prefetches every home slot before probing, so the cache misses overlap
+*/
+void HashIndex::findBatch(const std::pair<std::string, int> *queries, std::size_t total, Record **results) const
+{
+    const std::size_t Group = 16;
+    std::uint64_t hashes[Group];
+    for (std::size_t first = 0; first < total; first += Group)
+    {
+        std::size_t n = std::min(Group, total - first);
+        for (std::size_t j = 0; j < n; j++)
+        {
+            hashes[j] = hashOf(queries[first + j].first, queries[first + j].second);
+            __builtin_prefetch(&slots[hashes[j] & mask]);
+        }
+        for (std::size_t j = 0; j < n; j++)
+        {
+            const std::pair<std::string, int> &query = queries[first + j];
+            results[first + j] = nullptr;
+            for (std::size_t i = hashes[j] & mask; slots[i].record; i = (i + 1) & mask)
+                if (slots[i].hash == hashes[j] && slots[i].record->value == query.second && slots[i].record->key == query.first)
+                {
+                    results[first + j] = slots[i].record;
+                    break;
+                }
+        }
+    }
+}
+
+/*
+Removes by backward shift: each later slot in the probe run moves into the gap unless its home lies after the gap,
+which keeps every run contiguous without tombstones
+*/
+Record *HashIndex::erase(std::string_view key, int value)
+{
+    std::uint64_t hash = hashOf(key, value);
+    std::size_t i = hash & mask;
+    while (slots[i].record &&
+           !(slots[i].hash == hash && slots[i].record->value == value && slots[i].record->key == key))
+        i = (i + 1) & mask;
+    Record *removed = slots[i].record;
+    if (!removed)
+        return nullptr;
+
+    std::size_t gap = i;
+    for (std::size_t j = (gap + 1) & mask; slots[j].record; j = (j + 1) & mask)
+    {
+        std::size_t home = slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - gap) & mask)) // home is at or before the gap, cyclically
+        {
+            slots[gap] = slots[j];
+            gap = j;
+        }
+    }
+    slots[gap] = Slot{0, nullptr};
+    count--;
+    return removed;
+}
+
+void HashIndex::clear()
+{
+    std::fill(slots.begin(), slots.end(), Slot{0, nullptr});
+    count = 0;
+}
+
+// HotKeyCache Implementation
+HotKeyCache::HotKeyCache(std::size_t entries) : mask(0)
+{
+    std::size_t setCount = 1;
+    while (setCount * Ways < entries)
+        setCount <<= 1;
+    sets.reset(new Set[setCount]);
+    mask = setCount - 1;
+    clear();
+}
+
+Record *HotKeyCache::find(std::string_view key, int value, std::uint64_t hash)
+{
+    Set &set = sets[hash & mask];
+    std::uint32_t tag = (std::uint32_t)(hash >> 32);
+    for (int way = 0; way < Ways; way++)
+    {
+        if (set.tags[way].load(std::memory_order_relaxed) != tag)
+            continue;
+        Record *record = set.records[way].load(std::memory_order_acquire);
+        if (record && record->value == value && record->key == key)
+        {
+            if (!set.referenced[way].load(std::memory_order_relaxed)) // Skip the store, and the cache line write, when already set
+                set.referenced[way].store(1, std::memory_order_relaxed);
+            return record;
+        }
+    }
+    return nullptr;
+}
+
+/*
+CLOCK over the set's four entries. Concurrent readers may set bits again behind the hand, so after two sweeps the
+entry under the hand is taken regardless. Two readers filling the same record at once may both store it, which only
+costs an entry.
+*/
+void HotKeyCache::remember(Record *record, std::uint64_t hash)
+{
+    Set &set = sets[hash & mask];
+    int hand = set.hand.load(std::memory_order_relaxed) % Ways;
+    int victim = hand;
+    for (int step = 0; step < 2 * Ways; step++)
+    {
+        int way = (hand + step) % Ways;
+        if (!set.records[way].load(std::memory_order_relaxed) || !set.referenced[way].load(std::memory_order_relaxed))
+        {
+            victim = way;
+            break;
+        }
+        set.referenced[way].store(0, std::memory_order_relaxed); // Second chance used up
+    }
+    set.records[victim].store(record, std::memory_order_release);
+    set.tags[victim].store((std::uint32_t)(hash >> 32), std::memory_order_relaxed);
+    set.referenced[victim].store(0, std::memory_order_relaxed); // A key seen once goes before the ones that hit since
+    set.hand.store((std::uint8_t)((victim + 1) % Ways), std::memory_order_relaxed);
+}
+
+void HotKeyCache::forget(const Record *record)
+{
+    Set &set = sets[HashIndex::hashOf(record->key, record->value) & mask];
+    for (int way = 0; way < Ways; way++)
+        if (set.records[way].load(std::memory_order_relaxed) == record)
+            set.records[way].store(nullptr, std::memory_order_relaxed);
+}
+
+void HotKeyCache::clear()
+{
+    for (std::size_t i = 0; i <= mask; i++)
+    {
+        for (int way = 0; way < Ways; way++)
+        {
+            sets[i].records[way].store(nullptr, std::memory_order_relaxed);
+            sets[i].tags[way].store(0, std::memory_order_relaxed);
+            sets[i].referenced[way].store(0, std::memory_order_relaxed);
+        }
+        sets[i].hand.store(0, std::memory_order_relaxed);
+    }
+}
+
+// VersionStore Implementation
+VersionStore::VersionStore()
+    : epoch(1), keyRoot(nullptr), valueRoot(nullptr), generation(1), nodes(4096), versions(64), pendingNodes(0),
+      pendingRecords(0)
+{
+    for (ReaderSlot &slot : slots)
+        slot.epoch.store(0, std::memory_order_relaxed);
+    published.store(versions.create(Version{nullptr, nullptr}));
+}
+
+VersionStore::Node *VersionStore::makeNode(Record *record)
+{
+    return nodes.create(Node{nullptr, nullptr, record, record->value, 1, 1, generation});
+}
+
+/*
+Returns a node this write may change: nodes created since the last publish are used as they are, published ones are
+copied and the original is kept for readers until it is reclaimed
+*/
+VersionStore::Node *VersionStore::own(const Node *node)
+{
+    if (node->generation == generation)
+        return const_cast<Node *>(node);
+    Node *copy = nodes.create(*node);
+    copy->generation = generation;
+    retiredNodes.push_back(node);
+    pendingNodes++;
+    return copy;
+}
+
+void VersionStore::drop(const Node *node)
+{
+    if (node->generation == generation)
+        nodes.destroy(const_cast<Node *>(node)); // Never published, so no reader can have seen it
+    else
+    {
+        retiredNodes.push_back(node);
+        pendingNodes++;
+    }
+}
+
+void VersionStore::dropTree(const Node *node, bool records)
+{
+    if (!node)
+        return;
+    dropTree(node->left, records);
+    dropTree(node->right, records);
+    if (records)
+        retire(node->record);
+    drop(node);
+}
+
+int VersionStore::compare(const Record *record, const Node *node, bool byValue)
+{
+    if (byValue && record->value != node->value)
+        return record->value < node->value ? -1 : 1;
+    int cmp = record->key.compare(node->record->key);
+    if (cmp != 0 || byValue)
+        return cmp;
+    return record->value < node->value ? -1 : (record->value > node->value ? 1 : 0);
+}
+
+void VersionStore::update(Node *node)
+{
+    node->height = 1 + std::max(height(node->left), height(node->right));
+    node->size = 1 + sizeOf(node->left) + sizeOf(node->right);
+}
+
+VersionStore::Node *VersionStore::rotateLeft(Node *node)
+{
+    Node *right = own(node->right);
+    node->right = right->left;
+    update(node);
+    right->left = node;
+    update(right);
+    return right;
+}
+
+VersionStore::Node *VersionStore::rotateRight(Node *node)
+{
+    Node *left = own(node->left);
+    node->left = left->right;
+    update(node);
+    left->right = node;
+    update(left);
+    return left;
+}
+
+VersionStore::Node *VersionStore::balance(Node *node)
+{
+    update(node);
+    int factor = height(node->left) - height(node->right);
+    if (factor > 1)
+    {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotateLeft(own(node->left)); // Left-right case
+        return rotateRight(node);
+    }
+    if (factor < -1)
+    {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotateRight(own(node->right)); // Right-left case
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+const VersionStore::Node *VersionStore::insertInto(const Node *node, Record *record, bool byValue)
+{
+    if (!node)
+        return makeNode(record);
+    Node *copy = own(node);
+    if (compare(record, copy, byValue) < 0)
+        copy->left = insertInto(copy->left, record, byValue);
+    else
+        copy->right = insertInto(copy->right, record, byValue);
+    return balance(copy);
+}
+
+/*
+The record must be present: IndexedDatabase only erases what its primary index just removed
+*/
+const VersionStore::Node *VersionStore::eraseFrom(const Node *node, const Record *record, bool byValue)
+{
+    if (!node)
+        return nullptr;
+    int cmp = compare(record, node, byValue);
+    if (cmp != 0)
+    {
+        Node *copy = own(node);
+        if (cmp < 0)
+            copy->left = eraseFrom(copy->left, record, byValue);
+        else
+            copy->right = eraseFrom(copy->right, record, byValue);
+        return balance(copy);
+    }
+    if (!node->left || !node->right)
+    {
+        const Node *child = node->left ? node->left : node->right;
+        drop(node);
+        return child;
+    }
+    Record *successor;
+    const Node *right = removeMin(node->right, successor);
+    Node *copy = own(node);
+    copy->record = successor;
+    copy->value = successor->value;
+    copy->right = right;
+    return balance(copy);
+}
+
+const VersionStore::Node *VersionStore::removeMin(const Node *node, Record *&min)
+{
+    if (!node->left)
+    {
+        min = node->record;
+        const Node *right = node->right;
+        drop(node);
+        return right;
+    }
+    Node *copy = own(node);
+    copy->left = removeMin(copy->left, min);
+    return balance(copy);
+}
+
+const VersionStore::Node *VersionStore::build(const std::vector<Record *> &sorted, size_t begin, size_t end)
+{
+    if (begin >= end)
+        return nullptr;
+    size_t middle = begin + (end - begin) / 2;
+    Node *node = makeNode(sorted[middle]);
+    node->left = build(sorted, begin, middle);
+    node->right = build(sorted, middle + 1, end);
+    update(node);
+    return node;
+}
+
+void VersionStore::insert(Record *record)
+{
+    keyRoot = insertInto(keyRoot, record, false);
+    valueRoot = insertInto(valueRoot, record, true);
+}
+
+void VersionStore::erase(const Record *record)
+{
+    keyRoot = eraseFrom(keyRoot, record, false);
+    valueRoot = eraseFrom(valueRoot, record, true);
+}
+
+void VersionStore::rebuild(const std::vector<Record *> &byKey, const std::vector<Record *> &byValue)
+{
+    dropTree(keyRoot, false);
+    dropTree(valueRoot, false);
+    keyRoot = build(byKey, 0, byKey.size());
+    valueRoot = build(byValue, 0, byValue.size());
+}
+
+void VersionStore::clear()
+{
+    dropTree(keyRoot, true);
+    dropTree(valueRoot, false);
+    keyRoot = valueRoot = nullptr;
+}
+
+void VersionStore::retire(Record *record)
+{
+    retiredRecords.push_back(record);
+    pendingRecords++;
+}
+
+/*
+Installs the working roots as the current version. What they replaced is tagged with the epoch before the bump:
+a reader that pinned a later epoch pinned after the store above, so it can only have loaded this version or a newer one.
+*/
+void VersionStore::publish(std::vector<Record *> &freed)
+{
+    Retired entry;
+    entry.version = published.exchange(versions.create(Version{keyRoot, valueRoot}));
+    entry.epoch = epoch.fetch_add(1);
+    entry.nodes = pendingNodes;
+    entry.records = pendingRecords;
+    retired.push_back(entry);
+    pendingNodes = pendingRecords = 0;
+    generation++;
+    if (retired.size() >= ReclaimBatch)
+        reclaim(freed);
+}
+
+void VersionStore::reclaim(std::vector<Record *> &freed)
+{
+    std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+    for (const ReaderSlot &slot : slots)
+    {
+        std::uint64_t pinned = slot.epoch.load();
+        if (pinned != 0 && pinned < oldest)
+            oldest = pinned;
+    }
+    while (!retired.empty() && retired.front().epoch < oldest)
+    {
+        const Retired &entry = retired.front();
+        versions.destroy(const_cast<Version *>(entry.version));
+        for (size_t i = 0; i < entry.nodes; i++)
+            nodes.destroy(const_cast<Node *>(retiredNodes[i]));
+        retiredNodes.erase(retiredNodes.begin(), retiredNodes.begin() + entry.nodes);
+        freed.insert(freed.end(), retiredRecords.begin(), retiredRecords.begin() + entry.records);
+        retiredRecords.erase(retiredRecords.begin(), retiredRecords.begin() + entry.records);
+        retired.pop_front();
+    }
+}
+
+std::vector<Record *> VersionStore::drain()
+{
+    std::vector<Record *> records(retiredRecords.begin(), retiredRecords.end());
+    retiredRecords.clear();
+    retiredNodes.clear(); // The nodes go back with the pools
+    retired.clear();
+    pendingNodes = pendingRecords = 0;
+    return records;
+}
+
+size_t VersionStore::retiredCount() const
+{
+    return retiredNodes.size() + retiredRecords.size();
+}
+
+/*
+The slot is claimed before the version is loaded, so reclaim() either sees the pin or runs before the load and only
+frees versions this reader can no longer reach. Readers start at a slot picked by thread so they rarely collide.
+*/
+const VersionStore::Version *VersionStore::pin(int &slot) const
+{
+    std::uint64_t pinned = epoch.load();
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (;;)
+    {
+        for (int i = 0; i < ReaderSlots; i++)
+        {
+            int candidate = (int)((start + i) % ReaderSlots);
+            std::uint64_t expected = 0;
+            if (slots[candidate].epoch.load(std::memory_order_relaxed) == 0 &&
+                slots[candidate].epoch.compare_exchange_strong(expected, pinned))
+            {
+                slot = candidate;
+                return published.load();
+            }
+        }
+        std::this_thread::yield(); // Every slot is held, wait for a reader to finish
+    }
+}
+
+void VersionStore::unpin(int slot) const
+{
+    slots[slot].epoch.store(0, std::memory_order_release);
+}
+
+// ReadSnapshot Implementation
+ReadSnapshot::ReadSnapshot(const VersionStore *store) : store(store), version(nullptr), slot(-1)
+{
+    if (store)
+        version = store->pin(slot);
+}
+
+ReadSnapshot::ReadSnapshot(ReadSnapshot &&other) noexcept : store(other.store), version(other.version), slot(other.slot)
+{
+    other.store = nullptr;
+    other.version = nullptr;
+    other.slot = -1;
+}
+
+ReadSnapshot &ReadSnapshot::operator=(ReadSnapshot &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        std::swap(store, other.store);
+        std::swap(version, other.version);
+        std::swap(slot, other.slot);
+    }
+    return *this;
+}
+
+void ReadSnapshot::release()
+{
+    if (store)
+        store->unpin(slot);
+    store = nullptr;
+    version = nullptr;
+    slot = -1;
+}
+
+Record *ReadSnapshot::find(std::string_view key, int value) const
+{
+    OperationCounters::addSearch();
+    const VersionStore::Node *node = version ? version->byKey : nullptr;
+    while (node)
+    {
+        int cmp = key.compare(node->record->key);
+        if (cmp == 0)
+            cmp = value < node->value ? -1 : (value > node->value ? 1 : 0);
+        if (cmp == 0)
+            return node->record;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return nullptr;
+}
+
+static void versionRangeHelper(const VersionStore::Node *node, int start, int end, std::vector<Record *> &result)
+{
+    if (!node)
+        return;
+    if (node->value >= start)
+        versionRangeHelper(node->left, start, end, result);
+    if (node->value >= start && node->value <= end)
+        result.push_back(node->record);
+    if (node->value <= end)
+        versionRangeHelper(node->right, start, end, result);
+}
+
+static void versionInorderHelper(const VersionStore::Node *node, std::vector<Record *> &result)
+{
+    if (!node)
+        return;
+    versionInorderHelper(node->left, result);
+    result.push_back(node->record);
+    versionInorderHelper(node->right, result);
+}
+
+/*
+Records whose value is below bound (or at most bound when inclusive), from the subtree sizes in O(log n)
+*/
+static int versionCountBelow(const VersionStore::Node *node, int bound, bool inclusive)
+{
+    int count = 0;
+    while (node)
+    {
+        bool before = inclusive ? node->value <= bound : node->value < bound;
+        if (before)
+        {
+            count += 1 + (node->left ? node->left->size : 0);
+            node = node->right;
+        }
+        else
+            node = node->left;
+    }
+    return count;
+}
+
+std::vector<Record *> ReadSnapshot::rangeQuery(int start, int end) const
+{
+    std::vector<Record *> result;
+    if (version)
+        versionRangeHelper(version->byValue, start, end, result);
+    return result;
+}
+
+int ReadSnapshot::countRange(int start, int end) const
+{
+    if (!version || start > end)
+        return 0;
+    return versionCountBelow(version->byValue, end, true) - versionCountBelow(version->byValue, start, false);
+}
+
+std::vector<Record *> ReadSnapshot::inorderTraversal() const
+{
+    std::vector<Record *> result;
+    result.reserve(countRecords());
+    if (version)
+        versionInorderHelper(version->byKey, result);
+    return result;
+}
+
+int ReadSnapshot::countRecords() const
+{
+    return version && version->byKey ? version->byKey->size : 0;
+}
+
+// IndexedDatabase Implementation
+namespace
+{
+    bool sampleThisCall(int every)
+    {
+        thread_local unsigned calls = 0;
+        return ++calls % (unsigned)every == 0;
+    }
+
+    /*
+    Reports the time from construction to destruction, so declared first it also covers lock waits and log syncs.
+    Clock reads can cost as much as a cached lookup (some virtual machines serialize them), hence the sampling.
+    */
+    class LatencyTimer
+    {
+    private:
+        OperationCounters::TimedOp op;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        LatencyTimer(const std::atomic<int> &sampling, OperationCounters::TimedOp op) : op(op), active(false)
+        {
+            int every = sampling.load(std::memory_order_relaxed);
+            active = every > 0 && sampleThisCall(every);
+            if (active)
+                start = std::chrono::steady_clock::now();
+        }
+
+        ~LatencyTimer()
+        {
+            if (active)
+                OperationCounters::addLatency(op, (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                      std::chrono::steady_clock::now() - start)
+                                                      .count());
+        }
+    };
+}
+
+IndexedDatabase::IndexedDatabase(bool threadSafe)
+    : index(AVLTree::Ordering::ByKey), valueIndex(AVLTree::Ordering::ByValue), internKeys(false), threadSafe(threadSafe), versions(nullptr), latencySampling(0) {}
+
+IndexedDatabase::~IndexedDatabase()
+{
+    if (log)
+        log->close(); // Whatever is still in the open group reaches disk first
+    if (VersionStore *store = versions.exchange(nullptr))
+    {
+        for (Record *record : store->drain()) // No snapshot may outlive the database
+            releaseRecord(record);
+        delete store;
+    }
+    clearRecords();
+}
+
+/*
+Both guards come back unlocked when thread safety is off, so single-threaded callers pay nothing
+*/
+std::shared_lock<std::shared_mutex> IndexedDatabase::readLock() const
+{
+    return threadSafe ? std::shared_lock<std::shared_mutex>(mutex) : std::shared_lock<std::shared_mutex>();
+}
+
+std::unique_lock<std::shared_mutex> IndexedDatabase::writeLock()
+{
+    return threadSafe ? std::unique_lock<std::shared_mutex>(mutex) : std::unique_lock<std::shared_mutex>();
+}
+
+bool IndexedDatabase::insert(Record *record, OperationStats *stats)
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedInsert);
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    {
+        auto lock = writeLock();
+        if (refuseWrite() || !insertRecord(record, stats))
+            return false; // The caller still owns the record
+        target = log;
+        sequence = logWrite(WriteAheadLog::Insert, record->key, record->value);
+    }
+    return awaitLog(target, sequence); // Outside the lock, so other writers can join the same group commit
+}
+
+/*
+Records rejected by the primary index are not added to the value index, so both trees always hold the same set
+*/
+bool IndexedDatabase::insertRecord(Record *record, OperationStats *stats)
+{
+    OperationCounters::addInsert();
+    if (!index.insert(record, stats))
+        return false;
+    valueIndex.insert(record);
+    if (hashIndex)
+        hashIndex->insert(record);
+    if (frozen)
+    {
+        frozenDelta.insert(record);
+        if (frozenDelta.getNodeCount() > std::max(1024, frozen->size() / 8))
+            rebuildFrozen(); // Merge the delta back once it stops being small enough to stay cache resident
+    }
+    if (VersionStore *store = versions.load())
+    {
+        store->insert(record);
+        publishVersion(store);
+    }
+    return true;
+}
+
+/*
+Stores the record in the database's own slab pool, returns nullptr if the record is already present or the log
+has failed
+*/
+Record *IndexedDatabase::insert(std::string_view key, int value, OperationStats *stats)
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedInsert);
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    Record *record;
+    {
+        auto lock = writeLock();
+        if (refuseWrite())
+            return nullptr;
+        record = makeRecord(key, value);
+        if (!insertRecord(record, stats))
+        {
+            releaseRecord(record);
+            return nullptr;
+        }
+        target = log;
+        sequence = logWrite(WriteAheadLog::Insert, key, value);
+    }
+    return awaitLog(target, sequence) ? record : nullptr;
+}
+
+/*
+Loads many records at once and returns how many were added. Input already sorted by key is used as-is,
+anything else is sorted first, and is then merged with the existing records so both indexes are rebuilt
+balanced in one pass instead of paying a descent and rotations per record.
+The database takes ownership of every record passed in, exact duplicates are freed. Returns -1 if the log has failed.
+*/
+int IndexedDatabase::bulkLoad(const std::vector<Record *> &records, bool parallel)
+{
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    int added;
+    {
+        auto lock = writeLock();
+        if (refuseWrite())
+        {
+            for (Record *record : records)
+                releaseRecord(record);
+            return -1;
+        }
+        target = log;
+        sequence = logRecords(WriteAheadLog::Insert, records); // Duplicates are logged too and replay as no-ops
+        added = bulkLoadRecords(records, parallel);
+    }
+    return awaitLog(target, sequence) ? added : -1;
+}
+
+int IndexedDatabase::bulkLoadRecords(const std::vector<Record *> &records, bool parallel)
+{
+    auto byKey = [this](const Record *a, const Record *b)
+    { return index.compare(a->key, a->value, b) < 0; };
+    std::vector<Record *> incoming(records);
+    if (!std::is_sorted(incoming.begin(), incoming.end(), byKey))
+        std::sort(incoming.begin(), incoming.end(), byKey);
+
+    std::vector<Record *> existing;
+    existing.reserve(index.getNodeCount());
+    inorderHelper(index.root, existing);
+    std::vector<Record *> merged;
+    merged.reserve(existing.size() + incoming.size());
+    if (hashIndex)
+        hashIndex->reserve(existing.size() + incoming.size());
+    size_t i = 0, j = 0;
+    while (j < incoming.size())
+    {
+        if (i < existing.size() && !byKey(incoming[j], existing[i]))
+        {
+            if (!byKey(existing[i], incoming[j]))
+                releaseRecord(incoming[j++]); // Already stored, the existing record wins
+            else
+                merged.push_back(existing[i++]);
+        }
+        else if (!merged.empty() && !byKey(merged.back(), incoming[j]))
+            releaseRecord(incoming[j++]); // Repeated inside the input itself
+        else
+        {
+            if (hashIndex)
+                hashIndex->insert(incoming[j]);
+            merged.push_back(incoming[j++]);
+        }
+    }
+    merged.insert(merged.end(), existing.begin() + i, existing.end());
+    int added = (int)(merged.size() - existing.size());
+
+    // The value index needs its own order, sort it while the primary index is being built
+    std::vector<Record *> byValue;
+    auto valueBuild = std::async(parallel ? std::launch::async : std::launch::deferred, [&]()
+                                 {
+        byValue = sortedByValue(merged);
+        valueIndex.buildFromSorted(byValue, parallel); });
+    index.buildFromSorted(merged, parallel);
+    valueBuild.get();
+    if (frozen)
+        rebuildFrozen();
+    if (VersionStore *store = versions.load())
+    {
+        store->rebuild(merged, byValue);
+        publishVersion(store);
+    }
+    return added;
+}
+
+int IndexedDatabase::bulkLoad(const std::vector<std::pair<std::string, int>> &rows, bool parallel)
+{
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    int added;
+    {
+        auto lock = writeLock();
+        if (refuseWrite())
+            return -1;
+        std::vector<Record *> records;
+        records.reserve(rows.size());
+        for (const auto &row : rows)
+            records.push_back(makeRecord(row.first, row.second, records.empty() ? nullptr : records.back()));
+        target = log;
+        sequence = logRecords(WriteAheadLog::Insert, records);
+        added = bulkLoadRecords(records, parallel);
+    }
+    return awaitLog(target, sequence) ? added : -1;
+}
+
+/*
+Applies many inserts and deletes in one pass and returns how many of them changed the database, or -1 if the log
+has failed.
+Ops are ordered by (key, value), the last op for a given pair wins, and each index then takes all the deletes and
+then all the inserts as one split/join merge, instead of a descent and rebalance per op.
+*/
+int IndexedDatabase::applyBatch(const std::vector<BatchOp> &ops)
+{
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    int changed;
+    {
+        auto lock = writeLock();
+        if (refuseWrite())
+            return -1;
+        target = log;
+        changed = applyBatchRecords(ops, sequence);
+    }
+    return awaitLog(target, sequence) ? changed : -1;
+}
+
+/*
+Only the ops that took effect are logged, sequence receives the last one's sequence number
+*/
+int IndexedDatabase::applyBatchRecords(const std::vector<BatchOp> &ops, std::uint64_t &sequence)
+{
+    std::vector<const BatchOp *> sorted;
+    sorted.reserve(ops.size());
+    for (const BatchOp &op : ops)
+        sorted.push_back(&op);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const BatchOp *a, const BatchOp *b)
+                     {
+        int cmp = a->key.compare(b->key);
+        return cmp != 0 ? cmp < 0 : a->value < b->value; });
+
+    std::vector<const BatchOp *> deletes;
+    std::vector<Record *> inserts;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        if (i + 1 < sorted.size() && sorted[i + 1]->key == sorted[i]->key && sorted[i + 1]->value == sorted[i]->value)
+            continue; // A later op on the same record overrides this one
+        if (sorted[i]->kind == BatchOp::Delete)
+            deletes.push_back(sorted[i]);
+        else
+            inserts.push_back(makeRecord(sorted[i]->key, sorted[i]->value, inserts.empty() ? nullptr : inserts.back()));
+    }
+    OperationCounters::addInsert((int)inserts.size());
+    OperationCounters::addDelete((int)deletes.size());
+
+    std::vector<Record *> removed;
+    index.eraseSorted(deletes, removed);
+    std::vector<Record *> unused;
+    valueIndex.eraseSorted(sortedByValue(removed), unused);
+
+    std::vector<Record *> duplicates;
+    index.insertSorted(inserts, duplicates);
+    std::vector<Record *> added;
+    added.reserve(inserts.size() - duplicates.size());
+    std::set_difference(inserts.begin(), inserts.end(), duplicates.begin(), duplicates.end(), std::back_inserter(added),
+                        [this](const Record *a, const Record *b)
+                        { return index.compare(a->key, a->value, b) < 0; });
+    valueIndex.insertSorted(sortedByValue(added), unused);
+    if (hashIndex)
+    {
+        for (Record *record : removed)
+            hashIndex->erase(record->key, record->value);
+        for (Record *record : added)
+            hashIndex->insert(record);
+    }
+    if (hotCache)
+        for (Record *record : removed)
+            hotCache->forget(record);
+
+    if (frozen)
+    {
+        for (Record *record : removed)
+            if (!frozenDelta.deleteNode(record->key, record->value))
+                frozen->erase(record->key, record->value);
+        for (Record *record : added)
+            frozenDelta.insert(record);
+        if (frozenDelta.getNodeCount() > std::max(1024, frozen->size() / 8))
+            rebuildFrozen();
+    }
+    sequence = std::max(logRecords(WriteAheadLog::Delete, removed), logRecords(WriteAheadLog::Insert, added));
+    if (VersionStore *store = versions.load())
+    {
+        for (Record *record : removed)
+        {
+            store->erase(record);
+            store->retire(record); // Snapshots may still hold it
+        }
+        for (Record *record : added)
+            store->insert(record);
+        publishVersion(store); // The whole batch becomes visible at once
+    }
+    else
+    {
+        for (Record *record : removed)
+            releaseRecord(record);
+    }
+    for (Record *record : duplicates)
+        releaseRecord(record);
+    return (int)(removed.size() + added.size());
+}
+
+/*
+Records either come from the pool, with their key in the arena, or were handed over by the caller with new
+*/
+void IndexedDatabase::releaseRecord(Record *record)
+{
+    if (recordPool.owns(record))
+    {
+        if (!record->ownsKey)
+            keyArena.release(record->key);
+        recordPool.destroy(record);
+    }
+    else
+        delete record;
+}
+
+/*
+A pooled record whose key lives in the arena. With interning on, a key that is already stored (checked against previous,
+then against the primary index) is shared instead of copied again, so every version of a key holds one copy.
+*/
+Record *IndexedDatabase::makeRecord(std::string_view key, int value, const Record *previous)
+{
+    if (internKeys)
+    {
+        const Record *existing = previous;
+        if (!existing || existing->key != key)
+        {
+            AVLCursor cursor(index);
+            cursor.seek(key);
+            existing = cursor.record();
+        }
+        if (existing && !existing->ownsKey && existing->key == key)
+            return recordPool.create(keyArena.share(existing->key), value, false);
+    }
+    return recordPool.create(keyArena.store(key), value, false);
+}
+
+/*
+Point lookup shared by search, find and contains. Frozen databases check the snapshot and then the small delta tree,
+so the full primary index is never walked
+*/
+Record *IndexedDatabase::findRecord(std::string_view key, int value, OperationStats *stats) const
+{
+    OperationCounters::addSearch();
+    if (!hotCache)
+        return findIndexed(key, value, stats);
+    std::uint64_t hash = HashIndex::hashOf(key, value);
+    if (Record *hit = hotCache->find(key, value, hash))
+    {
+        OperationCounters::addCacheHit();
+        return hit;
+    }
+    OperationCounters::addCacheMiss();
+    Record *found = findIndexed(key, value, stats);
+    if (found)
+        hotCache->remember(found, hash);
+    return found;
+}
+
+Record *IndexedDatabase::findIndexed(std::string_view key, int value, OperationStats *stats) const
+{
+    if (hashIndex)
+        return hashIndex->find(key, value, stats);
+    if (!frozen)
+        return index.find(key, value, stats);
+
+    Record *found = frozen->find(key, value, stats);
+    if (!found && frozenDelta.getNodeCount() > 0)
+    {
+        OperationStats deltaStats;
+        found = frozenDelta.find(key, value, &deltaStats);
+        if (stats)
+            stats->comparisons += deltaStats.comparisons, stats->depth += deltaStats.depth;
+    }
+    return found;
+}
+
+int IndexedDatabase::rank(std::string_view key, int value) const
+{
+    auto lock = readLock();
+    return index.rank(key, value);
+}
+
+Record *IndexedDatabase::select(int i) const
+{
+    auto lock = readLock();
+    return index.select(i);
+}
+
+Record *IndexedDatabase::selectByValue(int i) const
+{
+    auto lock = readLock();
+    return valueIndex.select(i);
+}
+
+/*
+Same records as rangeQuery(start, end) counts, without visiting them: the value index orders by (value, key), and
+the empty key sorts before any other, so ("", v) is the first position a record with value v can take
+*/
+int IndexedDatabase::countRange(int start, int end) const
+{
+    auto lock = readLock();
+    int first;
+    return valueRanks(start, end, first);
+}
+
+/*
+Value index ranks covered by [start, end]: sets first to the rank of the first record and returns how many there are
+*/
+int IndexedDatabase::valueRanks(int start, int end, int &first) const
+{
+    first = valueIndex.countBefore("", start, false);
+    if (start > end)
+        return 0;
+    int upTo = end == std::numeric_limits<int>::max() ? valueIndex.getNodeCount() : valueIndex.countBefore("", end + 1, false);
+    return upTo - first;
+}
+
+/*
+Cuts ranks [first, first + count) of the value index into equal slices and calls scan(task, from, to) for each, the
+first on the calling thread and the rest through std::async. The caller holds the read lock until every task is done.
+*/
+template <typename Scan>
+void IndexedDatabase::parallelScan(int first, int count, Scan &scan) const
+{
+    int hardware = std::max(1, (int)std::thread::hardware_concurrency());
+    int tasks = std::max(1, std::min(hardware, count / AVLTree::ParallelScanThreshold));
+    std::vector<std::future<void>> others;
+    for (int task = 1; task < tasks; task++)
+        others.push_back(std::async(std::launch::async, [&scan, task, first, count, tasks]()
+                                    { scan(task, first + (int)((long long)count * task / tasks), first + (int)((long long)count * (task + 1) / tasks)); }));
+    scan(0, first, first + count / tasks);
+    for (auto &other : others)
+        other.get();
+}
+
+std::vector<Record *> IndexedDatabase::parallelRangeQuery(int start, int end) const
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedRange);
+    auto lock = readLock();
+    int first;
+    int count = valueRanks(start, end, first);
+    std::vector<Record *> result(count);
+    auto scan = [&](int, int from, int to)
+    {
+        Record **out = result.data() + (from - first); // Each task fills its own slice, so no merge is needed
+        auto visit = [&out](Record *record)
+        { *out++ = record; };
+        AVLTree::forEachRank(valueIndex.root, from, to, visit);
+    };
+    parallelScan(first, count, scan);
+    return result;
+}
+
+void IndexedDatabase::forEachInRange(int start, int end, const std::function<void(const Record *)> &visit) const
+{
+    auto lock = readLock();
+    int first;
+    int count = valueRanks(start, end, first);
+    AVLTree::forEachRank(valueIndex.root, first, first + count, visit);
+}
+
+/*
+Difference of two prefix sums over the value index, each one descent
+*/
+std::int64_t IndexedDatabase::valueSum(int start, int end) const
+{
+    if (start > end)
+        return 0;
+    std::int64_t below = valueIndex.sumBefore("", start, false);
+    std::int64_t upTo = end == std::numeric_limits<int>::max() ? AVLTree::subtreeSum(valueIndex.root) : valueIndex.sumBefore("", end + 1, false);
+    return upTo - below;
+}
+
+long long IndexedDatabase::sumRange(int start, int end) const
+{
+    auto lock = readLock();
+    return valueSum(start, end);
+}
+
+Record *IndexedDatabase::minRange(int start, int end) const
+{
+    auto lock = readLock();
+    int first;
+    return valueRanks(start, end, first) > 0 ? valueIndex.select(first) : nullptr;
+}
+
+Record *IndexedDatabase::maxRange(int start, int end) const
+{
+    auto lock = readLock();
+    int first;
+    int count = valueRanks(start, end, first);
+    return count > 0 ? valueIndex.select(first + count - 1) : nullptr;
+}
+
+/*
+The value index is ordered by value, so the range's smallest and largest values sit at its first and last ranks
+*/
+RangeAggregate IndexedDatabase::aggregate(int start, int end) const
+{
+    auto lock = readLock();
+    RangeAggregate total;
+    int first;
+    total.count = valueRanks(start, end, first);
+    if (total.count > 0)
+    {
+        total.sum = valueSum(start, end);
+        total.min = valueIndex.select(first)->value;
+        total.max = valueIndex.select(first + (int)total.count - 1)->value;
+    }
+    return total;
+}
+
+int IndexedDatabase::countKeyRange(std::string_view low, std::string_view high) const
+{
+    auto lock = readLock();
+    return index.countRange(low, std::numeric_limits<int>::min(), high, std::numeric_limits<int>::max());
+}
+
+std::vector<Record *> IndexedDatabase::multiSearch(const std::vector<std::pair<std::string, int>> &queries) const
+{
+    std::vector<Record *> results(queries.size(), nullptr);
+    auto lock = readLock(); // One shared lock for the whole batch
+    OperationCounters::addSearch((int)queries.size());
+    if (hashIndex)
+    {
+        hashIndex->findBatch(queries.data(), queries.size(), results.data());
+        return results;
+    }
+    if (!frozen)
+    {
+        index.findBatch(queries.data(), queries.size(), results.data());
+        return results;
+    }
+
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        results[i] = frozen->find(queries[i].first, queries[i].second); // The snapshot already prefetches its next levels
+        if (!results[i] && frozenDelta.getNodeCount() > 0)
+            results[i] = frozenDelta.find(queries[i].first, queries[i].second);
+    }
+    return results;
+}
+
+Record *IndexedDatabase::search(std::string_view key, int value, OperationStats *stats)
+{
+    static Record notFound("", 0);
+
+    LatencyTimer timer(latencySampling, OperationCounters::TimedFind);
+    auto lock = readLock();
+    Record *found = findRecord(key, value, stats);
+    return found ? found : &notFound; // Same shared sentinel contract as AVLTree::search
+}
+
+Record *IndexedDatabase::find(std::string_view key, int value, OperationStats *stats) const
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedFind);
+    auto lock = readLock();
+    return findRecord(key, value, stats);
+}
+
+bool IndexedDatabase::contains(std::string_view key, int value) const
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedFind);
+    auto lock = readLock();
+    return findRecord(key, value, nullptr) != nullptr;
+}
+
+/*
+All versions stored under one key are adjacent in the primary index, so only subtrees that can hold the key are visited
+*/
+void IndexedDatabase::keyMatchHelper(AVLNode *node, std::string_view key, std::vector<Record *> &result) const
+{
+    if (!node)
+        return;
+
+    int cmp = node->compareKey(key);
+    if (cmp <= 0)
+        keyMatchHelper(node->left, key, result);
+    if (cmp == 0)
+        result.push_back(node->record);
+    if (cmp >= 0)
+        keyMatchHelper(node->right, key, result);
+}
+
+std::vector<Record *> IndexedDatabase::searchAll(std::string_view key) const
+{
+    auto lock = readLock();
+    std::vector<Record *> result;
+    keyMatchHelper(index.root, key, result); // Versions come back ordered by value
+    return result;
+}
+
+bool IndexedDatabase::deleteRecord(std::string_view key, int value, OperationStats *stats)
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedDelete);
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    {
+        auto lock = writeLock();
+        if (refuseWrite() || !eraseRecord(key, value, stats))
+            return false;
+        target = log;
+        sequence = logWrite(WriteAheadLog::Delete, key, value);
+    }
+    return awaitLog(target, sequence);
+}
+
+bool IndexedDatabase::eraseRecord(std::string_view key, int value, OperationStats *stats)
+{
+    OperationCounters::addDelete();
+    Record *removed = index.deleteNode(key, value, stats);
+    if (!removed)
+        return false;
+    valueIndex.deleteNode(key, value); // Only drop the value index entry if the primary delete matched
+    if (hashIndex)
+        hashIndex->erase(key, value);
+    if (hotCache)
+        hotCache->forget(removed);
+    if (frozen && !frozenDelta.deleteNode(key, value))
+        frozen->erase(key, value);
+    if (VersionStore *store = versions.load())
+    {
+        store->erase(removed);
+        store->retire(removed); // Snapshots may still hold it
+        publishVersion(store);
+    }
+    else
+        releaseRecord(removed);
+    return true;
+}
+
+/* RangeQuery Hints
+1. Base: if (!node) return
+2. Key Traversal Logic (on the value index, which is ordered by value):
+   - If value >= start: check left subtree
+   - If start <= value <= end: add to result
+   - If value <= end: check right subtree
+*/
+
+void IndexedDatabase::rangeQueryHelper(AVLNode *node, int start, int end, std::vector<Record *> &result) const
+{
+    if (!node)
+        return;
+
+    if (node->record->value >= start)
+    {
+        rangeQueryHelper(node->left, start, end, result);       //If value greater than start, check left subtree
+    }
+
+    if (node->record->value >= start && node->record->value <= end)
+    {
+        result.push_back(node->record);                         //If value is between start and end, add to result
+    }
+
+    if (node->record->value <= end)
+    {
+        rangeQueryHelper(node->right, start, end, result);              //If value less than end, check right subtree
+    }
+}
+
+std::vector<Record *> IndexedDatabase::rangeQuery(int start, int end)
+{
+    LatencyTimer timer(latencySampling, OperationCounters::TimedRange);
+    auto lock = readLock();
+    std::vector<Record *> result;
+    rangeQueryHelper(valueIndex.root, start, end, result);          // The value index keeps records in value order, so only O(log n + k) nodes are visited
+    return result;
+}
+
+/*
+Returns the k records whose values are closest to key, nearest first (ties go to the smaller value).
+One seek on the value index lands on the first value >= key, a copy stepped back once sits on the value before it,
+and the two cursors then expand outwards like two pointers, so the cost is O(log n + k).
+*/
+std::vector<Record *> IndexedDatabase::findKNearestKeys(int key, int k)
+{
+    auto lock = readLock();
+    std::vector<Record *> result;
+    if (k <= 0)
+        return result;
+
+    AVLCursor after = valueCursor();
+    after.seek("", key); // "" sorts before every key, so this is the first record with value >= key
+    AVLCursor before = after;
+    if (before.valid())
+        before.prev();
+    else
+        before.seekLast();
+
+    result.reserve(std::min(k, valueIndex.getNodeCount()));
+    while ((int)result.size() < k && (after.valid() || before.valid()))
+    {
+        bool takeAfter = !before.valid();
+        if (after.valid() && before.valid())
+        {
+            long long afterDistance = (long long)after.record()->value - key;
+            long long beforeDistance = (long long)key - before.record()->value;
+            takeAfter = afterDistance < beforeDistance;
+        }
+
+        if (takeAfter)
+        {
+            result.push_back(after.record());
+            after.next();
+        }
+        else
+        {
+            result.push_back(before.record());
+            before.prev();
+        }
+    }
+    return result;
+}
+
+void IndexedDatabase::inorderHelper(AVLNode *node, std::vector<Record *> &result) const
+{
+    if (!node)
+        return;
+    inorderHelper(node->left, result);
+    result.push_back(node->record);
+    inorderHelper(node->right, result);
+}
+
+std::vector<Record *> IndexedDatabase::inorderTraversal()
+{
+    auto lock = readLock();
+    std::vector<Record *> result;
+    result.reserve(index.getNodeCount());
+    inorderHelper(index.root, result); // Records in (key, value) order
+    return result;
+}
+
+void IndexedDatabase::forEachRecord(const std::function<void(const Record *)> &visit) const
+{
+    auto lock = readLock();
+    AVLTree::forEachRank(index.root, 0, index.getNodeCount(), visit);
+}
+
+void IndexedDatabase::clearHelper(AVLNode *node)
+{
+    if (!node)
+        return;
+    clearHelper(node->left);
+    clearHelper(node->right);
+    if (!recordPool.owns(node->record))
+        delete node->record; // Pooled records and their arena keys go away in bulk below
+}
+
+/*
+Nodes are never visited one by one: both trees drop their node slabs wholesale
+*/
+bool IndexedDatabase::clearDatabase()
+{
+    std::shared_ptr<WriteAheadLog> target;
+    std::uint64_t sequence = 0;
+    {
+        auto lock = writeLock();
+        if (refuseWrite())
+            return false;
+        clearRecords();
+        target = log;
+        sequence = logWrite(WriteAheadLog::Clear, std::string(), 0);
+    }
+    return awaitLog(target, sequence);
+}
+
+void IndexedDatabase::clearRecords()
+{
+    frozen.reset();
+    frozenDelta.reset();
+    if (hashIndex)
+        hashIndex->clear();
+    if (hotCache)
+        hotCache->clear();
+    if (VersionStore *store = versions.load())
+    {
+        store->clear(); // Records are freed one by one once no snapshot can reach them
+        publishVersion(store);
+        valueIndex.reset();
+        index.reset();
+        return;
+    }
+    clearHelper(index.root);
+    valueIndex.reset();
+    index.reset();
+    recordPool.releaseAll();
+    keyArena.releaseAll(); // Every arena key belonged to a pooled record
+}
+
+void IndexedDatabase::enableKeyInterning()
+{
+    auto lock = writeLock();
+    internKeys = true;
+}
+
+void IndexedDatabase::disableKeyInterning()
+{
+    auto lock = writeLock();
+    internKeys = false; // Keys already shared stay shared until their records go
+}
+
+size_t IndexedDatabase::keyArenaBytes() const
+{
+    auto lock = readLock();
+    return keyArena.bytesInUse();
+}
+
+/*
+Publishes the pending change to snapshot readers and frees whatever the readers have all moved past
+*/
+void IndexedDatabase::publishVersion(VersionStore *store)
+{
+    std::vector<Record *> freed;
+    store->publish(freed);
+    for (Record *record : freed)
+        releaseRecord(record);
+}
+
+/*
+Seeds the persistent trees from the current records. From here on every write costs an extra O(log n) path copy per
+ordering, in exchange for lock-free snapshots.
+*/
+void IndexedDatabase::enableVersioning()
+{
+    auto lock = writeLock();
+    if (versions.load())
+        return;
+    VersionStore *store = new VersionStore();
+    std::vector<Record *> byKey;
+    byKey.reserve(index.getNodeCount());
+    inorderHelper(index.root, byKey);
+    store->rebuild(byKey, sortedByValue(byKey));
+    std::vector<Record *> freed;
+    store->publish(freed);
+    versions.store(store);
+}
+
+ReadSnapshot IndexedDatabase::snapshot() const
+{
+    return ReadSnapshot(versions.load()); // No lock: the snapshot pins whatever version is current
+}
+
+/*
+Builds the hash index from the primary index; from then on every write keeps it in step
+*/
+void IndexedDatabase::enableHashIndex()
+{
+    auto lock = writeLock();
+    if (hashIndex)
+        return;
+    std::vector<Record *> records;
+    records.reserve(index.getNodeCount());
+    inorderHelper(index.root, records);
+    hashIndex.reset(new HashIndex(records.size()));
+    for (Record *record : records)
+        hashIndex->insert(record);
+}
+
+void IndexedDatabase::disableHashIndex()
+{
+    auto lock = writeLock();
+    hashIndex.reset();
+}
+
+bool IndexedDatabase::hasHashIndex() const
+{
+    auto lock = readLock();
+    return hashIndex != nullptr;
+}
+
+/*
+Starts empty and fills from lookups that reach the index; enabling it again starts over at the new size
+*/
+void IndexedDatabase::enableHotKeyCache(std::size_t entries)
+{
+    auto lock = writeLock();
+    hotCache.reset(new HotKeyCache(entries));
+}
+
+void IndexedDatabase::disableHotKeyCache()
+{
+    auto lock = writeLock();
+    hotCache.reset();
+}
+
+bool IndexedDatabase::hasHotKeyCache() const
+{
+    auto lock = readLock();
+    return hotCache != nullptr;
+}
+
+/*
+Snapshots the primary index into a FrozenIndex in O(n). Until thaw(), inserts also go to a small delta tree
+that is folded into a fresh snapshot whenever it outgrows an eighth of the frozen records
+*/
+void IndexedDatabase::freeze()
+{
+    auto lock = writeLock();
+    rebuildFrozen();
+}
+
+void IndexedDatabase::thaw()
+{
+    auto lock = writeLock();
+    frozen.reset();
+    frozenDelta.reset();
+}
+
+bool IndexedDatabase::isFrozen() const
+{
+    auto lock = readLock();
+    return frozen != nullptr;
+}
+
+void IndexedDatabase::rebuildFrozen()
+{
+    std::vector<Record *> sorted;
+    sorted.reserve(index.getNodeCount());
+    inorderHelper(index.root, sorted);
+    frozen.reset(new FrozenIndex(sorted));
+    frozenDelta.reset();
+}
+
+// Snapshot persistence
+namespace
+{
+    const char SnapshotMagic[8] = {'A', 'V', 'L', 'S', 'N', 'A', 'P', '\0'};
+    const std::uint32_t SnapshotVersion = 1;
+
+    /*
+    File layout, in native byte order: this header, recordCount entries in (key, value) order, then all key bytes.
+    checksum is FNV-1a over everything after the header.
+    */
+    struct SnapshotHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t entrySize;  // sizeof(SnapshotEntry), guards against a layout change without a version bump
+        std::uint64_t recordCount;
+        std::uint64_t keyBytes;
+        std::uint64_t checksum;
+    };
+
+    struct SnapshotEntry
+    {
+        std::uint64_t keyOffset;
+        std::uint32_t keyLength;
+        std::int32_t value;
+    };
+
+    const std::uint64_t FnvOffset = 14695981039346656037ULL;
+
+    std::uint64_t fnv1a(std::uint64_t hash, const void *data, size_t size)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    /*
+    Read-only mapping of a whole file, unmapped on destruction. data() is nullptr if the file could not be mapped.
+    */
+    class MappedFile
+    {
+    private:
+        const char *bytes;
+        size_t length;
+#ifdef _WIN32
+        HANDLE file, mapping;
+#endif
+
+    public:
+        explicit MappedFile(const std::string &path) : bytes(nullptr), length(0)
+        {
+#ifdef _WIN32
+            mapping = nullptr;
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            LARGE_INTEGER size;
+            if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0)
+                return;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping)
+                return;
+            bytes = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            length = bytes ? (size_t)size.QuadPart : 0;
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0)
+            {
+                void *mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED)
+                {
+                    bytes = static_cast<const char *>(mapped);
+                    length = (size_t)info.st_size;
+                    madvise(mapped, length, MADV_SEQUENTIAL); // The load reads the file front to back once
+                }
+            }
+            close(fd); // The mapping stays valid without the descriptor
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            if (bytes)
+                UnmapViewOfFile(bytes);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+#else
+            if (bytes)
+                munmap(const_cast<char *>(bytes), length);
+#endif
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const char *data() const { return bytes; }
+        size_t size() const { return length; }
+    };
+}
+
+/*
+Writes every record in key order to path + ".tmp" and renames it over path once complete,
+so a crash mid-save never leaves a torn snapshot behind
+*/
+bool IndexedDatabase::saveSnapshot(const std::string &path) const
+{
+    auto lock = readLock();
+    return saveSnapshotRecords(path);
+}
+
+bool IndexedDatabase::saveSnapshotRecords(const std::string &path) const
+{
+    std::vector<Record *> records;
+    records.reserve(index.getNodeCount());
+    inorderHelper(index.root, records);
+
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+    header.version = SnapshotVersion;
+    header.entrySize = sizeof(SnapshotEntry);
+    header.recordCount = records.size();
+
+    std::string temporary = path + ".tmp";
+    FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1; // Rewritten with the checksum at the end
+
+    std::uint64_t checksum = FnvOffset;
+    for (const Record *record : records)
+    {
+        if (!ok)
+            break;
+        SnapshotEntry entry = {header.keyBytes, (std::uint32_t)record->key.size(), record->value};
+        header.keyBytes += record->key.size();
+        checksum = fnv1a(checksum, &entry, sizeof(entry));
+        ok = std::fwrite(&entry, sizeof(entry), 1, file) == 1;
+    }
+    for (const Record *record : records)
+    {
+        if (!ok || record->key.empty())
+            continue;
+        checksum = fnv1a(checksum, record->key.data(), record->key.size());
+        ok = std::fwrite(record->key.data(), record->key.size(), 1, file) == 1;
+    }
+    header.checksum = checksum;
+    ok = ok && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = std::fclose(file) == 0 && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING); // rename() will not replace
+#else
+    ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok)
+        std::remove(temporary.c_str());
+    return ok;
+}
+
+/*
+Replaces the database's contents with a snapshot. The file is mapped rather than read and fully validated first,
+and the records, already in key order, then go through the O(n) bulk build. A frozen database is refrozen afterwards.
+*/
+bool IndexedDatabase::loadSnapshot(const std::string &path)
+{
+    MappedFile file(path);
+    if (!file.data() || file.size() < sizeof(SnapshotHeader))
+        return false;
+    SnapshotHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0 || header.version != SnapshotVersion ||
+        header.entrySize != sizeof(SnapshotEntry))
+        return false;
+    size_t payload = file.size() - sizeof(SnapshotHeader);
+    if (header.recordCount > payload / sizeof(SnapshotEntry) ||
+        header.recordCount > (std::uint64_t)std::numeric_limits<int>::max() ||
+        header.keyBytes != payload - header.recordCount * sizeof(SnapshotEntry))
+        return false;
+    if (fnv1a(FnvOffset, file.data() + sizeof(SnapshotHeader), payload) != header.checksum)
+        return false;
+
+    size_t count = (size_t)header.recordCount;
+    std::vector<SnapshotEntry> entries(count);
+    if (count > 0)
+        std::memcpy(entries.data(), file.data() + sizeof(SnapshotHeader), count * sizeof(SnapshotEntry));
+    const char *keys = file.data() + sizeof(SnapshotHeader) + count * sizeof(SnapshotEntry);
+    for (size_t i = 0; i < count; i++)
+    {
+        const SnapshotEntry &entry = entries[i];
+        if (entry.keyOffset > header.keyBytes || entry.keyLength > header.keyBytes - entry.keyOffset)
+            return false;
+        if (i > 0)
+        {
+            const SnapshotEntry &previous = entries[i - 1];
+            int cmp = std::string_view(keys + previous.keyOffset, previous.keyLength)
+                          .compare(std::string_view(keys + entry.keyOffset, entry.keyLength));
+            if (cmp > 0 || (cmp == 0 && previous.value >= entry.value))
+                return false; // Entries must be strictly increasing, as saveSnapshot writes them
+        }
+    }
+
+    auto lock = writeLock();
+    bool wasFrozen = frozen != nullptr;
+    clearRecords();
+    std::vector<Record *> records;
+    records.reserve(count);
+    for (const SnapshotEntry &entry : entries)
+        records.push_back(makeRecord(std::string_view(keys + entry.keyOffset, entry.keyLength), entry.value,
+                                     records.empty() ? nullptr : records.back()));
+    bulkLoadRecords(records, false);
+    if (wasFrozen)
+        rebuildFrozen();
+    return true;
+}
+
+// Write-ahead log
+namespace
+{
+    /*
+    Each log record is this header followed by keyLength key bytes, in native byte order.
+    checksum is FNV-1a over the rest of the header and the key, folded to 32 bits.
+    */
+    struct WalRecordHeader
+    {
+        std::uint32_t checksum;
+        std::uint32_t keyLength;
+        std::int32_t value;
+        std::uint8_t op;
+        std::uint8_t padding[3];
+    };
+
+    std::uint32_t walChecksum(const WalRecordHeader &header, const char *key)
+    {
+        std::uint64_t hash = fnv1a(FnvOffset, &header.keyLength, sizeof(header) - sizeof(header.checksum));
+        hash = fnv1a(hash, key, header.keyLength);
+        return (std::uint32_t)(hash ^ (hash >> 32));
+    }
+
+    bool syncFile(std::FILE *file)
+    {
+        if (std::fflush(file) != 0)
+            return false;
+#ifdef _WIN32
+        return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file))) != 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+}
+
+WriteAheadLog::WriteAheadLog()
+    : file(nullptr), appended(0), durable(0), flushRequested(false), stopping(false), failed(false) {}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    close();
+}
+
+/*
+Opens path for appending, creating it if needed, and starts the flusher thread
+*/
+bool WriteAheadLog::open(const std::string &path, const WalOptions &settings)
+{
+    close();
+    file = std::fopen(path.c_str(), "ab");
+    if (!file)
+        return false;
+    options = settings;
+    appended = durable = 0;
+    flushRequested = stopping = failed = false;
+    flusher = std::thread(&WriteAheadLog::flusherLoop, this);
+    return true;
+}
+
+/*
+Writes and syncs whatever is still pending, then stops the flusher and closes the file
+*/
+void WriteAheadLog::close()
+{
+    if (!file)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    flusher.join();
+    std::fclose(file);
+    file = nullptr;
+}
+
+std::uint64_t WriteAheadLog::append(Op op, std::string_view key, int value)
+{
+    WalRecordHeader header = {};
+    header.keyLength = (std::uint32_t)key.size();
+    header.value = value;
+    header.op = op;
+    header.checksum = walChecksum(header, key.data());
+
+    bool notify;
+    std::uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed)
+            return 0; // Nothing after a lost group may reach the file, replay would apply it without the group
+        notify = pending.empty(); // A new group starts its timer
+        const char *bytes = reinterpret_cast<const char *>(&header);
+        pending.insert(pending.end(), bytes, bytes + sizeof(header));
+        pending.insert(pending.end(), key.begin(), key.end());
+        sequence = ++appended;
+        if (pending.size() >= options.groupCommitBytes && !flushRequested)
+            notify = flushRequested = true; // Or one just filled up
+    }
+    if (notify)
+        wake.notify_one();
+    return sequence;
+}
+
+bool WriteAheadLog::waitDurable(std::uint64_t sequence)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    synced.wait(lock, [&]()
+                { return durable >= sequence || failed; }); // The flusher drains everything before it exits
+    return durable >= sequence && !failed;
+}
+
+bool WriteAheadLog::flush()
+{
+    std::uint64_t target;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target = appended;
+        flushRequested = true;
+    }
+    wake.notify_one();
+    return waitDurable(target);
+}
+
+/*
+Empties the file. Pending records are synced first, so the caller must hold off new appends until this returns
+*/
+bool WriteAheadLog::truncate()
+{
+    if (!file || !flush())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex); // Keeps the flusher out while the file is swapped
+#ifdef _WIN32
+    bool ok = _chsize_s(_fileno(file), 0) == 0;
+#else
+    bool ok = ftruncate(fileno(file), 0) == 0;
+#endif
+    return ok && syncFile(file);
+}
+
+bool WriteAheadLog::writeGroup(const std::vector<char> &group)
+{
+    return std::fwrite(group.data(), 1, group.size(), file) == group.size() && syncFile(file);
+}
+
+/*
+Waits for a group to open, gives it until groupCommitMicros after its first record (or until it fills, a flush is
+requested or the log closes), then writes and syncs it without holding the mutex so writers keep appending
+*/
+void WriteAheadLog::flusherLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<char> group;
+    while (true)
+    {
+        wake.wait(lock, [&]()
+                  { return stopping || !pending.empty(); });
+        if (pending.empty())
+            break; // Stopping with nothing left to write
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(options.groupCommitMicros);
+        wake.wait_until(lock, deadline, [&]()
+                        { return stopping || flushRequested; });
+
+        group.swap(pending);
+        pending.clear();
+        std::uint64_t upTo = appended;
+        flushRequested = false;
+        lock.unlock();
+        bool ok = writeGroup(group);
+        lock.lock();
+        if (ok)
+            durable = upTo;
+        else
+            failed = true;
+        synced.notify_all();
+    }
+    synced.notify_all();
+}
+
+long long WriteAheadLog::replay(const std::string &path, const std::function<void(Op, const std::string &, int)> &apply)
+{
+    std::error_code error;
+    if (!std::filesystem::exists(path, error))
+        return error ? -1 : 0; // No log yet
+    if (!std::filesystem::is_regular_file(path, error))
+        return error ? -1 : 0; // A device or pipe holds nothing to replay
+    MappedFile mapped(path);
+    if (!mapped.data())
+        return std::filesystem::file_size(path, error) == 0 && !error ? 0 : -1; // Empty files cannot be mapped
+
+    size_t offset = 0;
+    std::string key;
+    while (mapped.size() - offset >= sizeof(WalRecordHeader))
+    {
+        WalRecordHeader header;
+        std::memcpy(&header, mapped.data() + offset, sizeof(header));
+        const char *keyBytes = mapped.data() + offset + sizeof(header);
+        if (header.keyLength > mapped.size() - offset - sizeof(header) || walChecksum(header, keyBytes) != header.checksum ||
+            header.op < Insert || header.op > Clear)
+            break; // Torn or damaged tail: everything from here on is discarded
+        key.assign(keyBytes, header.keyLength);
+        apply((Op)header.op, key, header.value);
+        offset += sizeof(header) + header.keyLength;
+    }
+    return (long long)offset;
+}
+
+std::uint64_t IndexedDatabase::logWrite(WriteAheadLog::Op op, std::string_view key, int value)
+{
+    return log ? log->append(op, key, value) : 0;
+}
+
+std::uint64_t IndexedDatabase::logRecords(WriteAheadLog::Op op, const std::vector<Record *> &records)
+{
+    std::uint64_t sequence = 0;
+    if (log)
+        for (const Record *record : records)
+            sequence = log->append(op, record->key, record->value);
+    return sequence;
+}
+
+/*
+Writes are refused once the log has failed, because it could not record them and replay would lose them
+*/
+bool IndexedDatabase::refuseWrite() const
+{
+    return log && log->hasFailed();
+}
+
+/*
+False if the log failed before sequence was synced. Without waitForDurable only failures seen so far are reported.
+*/
+bool IndexedDatabase::awaitLog(std::shared_ptr<WriteAheadLog> target, std::uint64_t sequence)
+{
+    if (!target)
+        return true;
+    if (sequence && target->waitsForDurable())
+        return target->waitDurable(sequence);
+    return !target->hasFailed(); // Also covers an append refused because the log had just failed
+}
+
+/*
+Replays the log at path over the current contents, cuts off any torn tail so new records follow the last intact
+one, and then logs every change made after it. Replayed ops are applied in batches through the split/join merge.
+*/
+bool IndexedDatabase::openLog(const std::string &path, const WalOptions &options)
+{
+    auto lock = writeLock();
+    if (log)
+        log->close();
+    log.reset();
+
+    std::vector<BatchOp> ops;
+    std::uint64_t unused;
+    long long intact = WriteAheadLog::replay(path, [&](WriteAheadLog::Op op, const std::string &key, int value)
+                                             {
+        if (op == WriteAheadLog::Clear)
+        {
+            applyBatchRecords(ops, unused);
+            ops.clear();
+            clearRecords();
+            return;
+        }
+        ops.push_back({op == WriteAheadLog::Insert ? BatchOp::Insert : BatchOp::Delete, key, value});
+        if (ops.size() >= 1 << 16)
+        {
+            applyBatchRecords(ops, unused);
+            ops.clear();
+        } });
+    applyBatchRecords(ops, unused);
+    if (intact < 0)
+        return false;
+
+    std::error_code error;
+    if (std::filesystem::exists(path, error) && std::filesystem::is_regular_file(path, error) &&
+        (long long)std::filesystem::file_size(path, error) > intact)
+        std::filesystem::resize_file(path, (std::uintmax_t)intact, error);
+    if (error)
+        return false;
+
+    auto opened = std::make_shared<WriteAheadLog>();
+    if (!opened->open(path, options))
+        return false;
+    log = opened;
+    return true;
+}
+
+/*
+Saves a snapshot and then empties the log, all under the write lock so no change falls between the two.
+Recovery is loadSnapshot followed by openLog; a crash before the log is emptied only replays changes the snapshot
+already holds, which leaves the same records.
+*/
+bool IndexedDatabase::checkpoint(const std::string &snapshotPath)
+{
+    auto lock = writeLock();
+    if (log && !log->flush())
+        return false;
+    if (!saveSnapshotRecords(snapshotPath))
+        return false;
+    return !log || log->truncate();
+}
+
+bool IndexedDatabase::flushLog()
+{
+    std::shared_ptr<WriteAheadLog> target;
+    {
+        auto lock = writeLock();
+        target = log;
+    }
+    return !target || target->flush();
+}
+
+void IndexedDatabase::closeLog()
+{
+    std::shared_ptr<WriteAheadLog> target;
+    {
+        auto lock = writeLock();
+        target.swap(log);
+    }
+    if (target)
+        target->close();
+}
+
+bool IndexedDatabase::logFailed() const
+{
+    auto lock = readLock();
+    return log && log->hasFailed();
+}
+
+/*
+Everything here reads counters the structures already keep, except the tree shape, which probes shapeSamples ranks
+*/
+DatabaseStats IndexedDatabase::stats(int shapeSamples) const
+{
+    auto lock = readLock();
+    DatabaseStats result;
+    result.records = (std::size_t)index.getNodeCount();
+    result.nodeBytes = (std::size_t)(index.getNodeCount() + valueIndex.getNodeCount()) * sizeof(AVLNode);
+    result.nodeSlabBytes = index.slabBytes() + valueIndex.slabBytes();
+    result.recordBytes = recordPool.liveCount() * sizeof(Record);
+    result.recordSlabBytes = recordPool.capacity() * sizeof(Record);
+    result.keyBytes = keyArena.bytesInUse();
+    result.keyArenaBytes = keyArena.bytesReserved();
+    result.hashIndexBytes = hashIndex ? hashIndex->memoryBytes() : 0;
+    result.hotCacheBytes = hotCache ? hotCache->memoryBytes() : 0;
+    result.frozenBytes = frozen ? frozen->memoryBytes() + frozenDelta.slabBytes() : 0;
+    if (const VersionStore *store = versions.load())
+        result.versionBytes = store->memoryBytes();
+    result.keyIndex = index.shape(shapeSamples);
+    return result;
+}
+
+namespace
+{
+    void appendMetric(std::string &out, const char *name, const char *help, const char *type)
+    {
+        out += "# HELP avldb_";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE avldb_";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    void appendSample(std::string &out, const std::string &name, const std::string &labels, double value)
+    {
+        char number[32];
+        bool whole = value == std::floor(value) && std::fabs(value) < 1e15; // Counters keep every digit
+        std::snprintf(number, sizeof(number), whole ? "%.0f" : "%.9g", value);
+        out += "avldb_" + name;
+        if (!labels.empty())
+            out += "{" + labels + "}";
+        out += ' ';
+        out += number;
+        out += '\n';
+    }
+}
+
+/*
+Gauges describe this database, counters and latency histograms are OperationCounters totals for the whole process
+*/
+std::string IndexedDatabase::metricsText() const
+{
+    DatabaseStats current = stats();
+    OperationCounters::Totals totals = OperationCounters::totals();
+    std::string out;
+
+    appendMetric(out, "records", "Records stored.", "gauge");
+    appendSample(out, "records", "", (double)current.records);
+
+    appendMetric(out, "memory_bytes", "Bytes in use, by structure.", "gauge");
+    const std::pair<const char *, std::size_t> used[] = {
+        {"nodes", current.nodeBytes}, {"records", current.recordBytes}, {"keys", current.keyBytes},
+        {"hash_index", current.hashIndexBytes}, {"hot_cache", current.hotCacheBytes}, {"frozen", current.frozenBytes},
+        {"versions", current.versionBytes}};
+    for (const auto &entry : used)
+        appendSample(out, "memory_bytes", std::string("kind=\"") + entry.first + "\"", (double)entry.second);
+
+    appendMetric(out, "reserved_bytes", "Bytes reserved by the slab and arena allocators.", "gauge");
+    appendSample(out, "reserved_bytes", "pool=\"nodes\"", (double)current.nodeSlabBytes);
+    appendSample(out, "reserved_bytes", "pool=\"records\"", (double)current.recordSlabBytes);
+    appendSample(out, "reserved_bytes", "pool=\"key_chunks\"", (double)current.keyArenaBytes);
+
+    appendMetric(out, "slab_utilization", "Share of reserved slab bytes holding live objects.", "gauge");
+    appendSample(out, "slab_utilization", "pool=\"nodes\"",
+                 current.nodeSlabBytes ? (double)current.nodeBytes / current.nodeSlabBytes : 0);
+    appendSample(out, "slab_utilization", "pool=\"records\"",
+                 current.recordSlabBytes ? (double)current.recordBytes / current.recordSlabBytes : 0);
+
+    appendMetric(out, "tree_height", "Height of the primary index.", "gauge");
+    appendSample(out, "tree_height", "", current.keyIndex.height);
+    appendMetric(out, "tree_average_depth", "Mean node depth in the primary index, the root at 1.", "gauge");
+    appendSample(out, "tree_average_depth", "", current.keyIndex.averageDepth);
+    appendMetric(out, "tree_balance_ratio", "Share of primary index nodes by balance factor.", "gauge");
+    for (int factor = -1; factor <= 1; factor++)
+        appendSample(out, "tree_balance_ratio", "factor=\"" + std::to_string(factor) + "\"",
+                     current.keyIndex.sampled ? (double)current.keyIndex.balance[factor + 1] / current.keyIndex.sampled : 0);
+
+    appendMetric(out, "operations_total", "Tree operations in this process.", "counter");
+    appendSample(out, "operations_total", "op=\"search\"", (double)totals.searches);
+    appendSample(out, "operations_total", "op=\"insert\"", (double)totals.inserts);
+    appendSample(out, "operations_total", "op=\"delete\"", (double)totals.deletes);
+    appendMetric(out, "key_comparisons_total", "Key comparisons in this process.", "counter");
+    appendSample(out, "key_comparisons_total", "", (double)totals.comparisons);
+    appendMetric(out, "rotations_total", "Tree rotations in this process.", "counter");
+    appendSample(out, "rotations_total", "", (double)totals.rotations);
+    appendMetric(out, "hot_cache_lookups_total", "Hot-key cache lookups in this process.", "counter");
+    appendSample(out, "hot_cache_lookups_total", "result=\"hit\"", (double)totals.cacheHits);
+    appendSample(out, "hot_cache_lookups_total", "result=\"miss\"", (double)totals.cacheMisses);
+
+    appendMetric(out, "operation_latency_seconds", "Latency of sampled operations in this process.", "histogram");
+    const char *names[OperationCounters::TimedOps] = {"insert", "find", "delete", "range"};
+    for (int op = 0; op < OperationCounters::TimedOps; op++)
+    {
+        std::string label = std::string("op=\"") + names[op] + "\"";
+        unsigned long long cumulative = 0;
+        for (int bucket = 0; bucket < OperationCounters::LatencyBuckets - 1; bucket++)
+        {
+            cumulative += totals.latency[op][bucket];
+            if (bucket < 6)
+                continue; // Nothing times under 64 ns, those buckets only feed the cumulative count
+            char bound[32];
+            std::snprintf(bound, sizeof(bound), "%.9g", std::ldexp(1e-9, bucket));
+            appendSample(out, "operation_latency_seconds_bucket", label + ",le=\"" + bound + "\"", (double)cumulative);
+        }
+        cumulative += totals.latency[op][OperationCounters::LatencyBuckets - 1];
+        appendSample(out, "operation_latency_seconds_bucket", label + ",le=\"+Inf\"", (double)cumulative);
+        appendSample(out, "operation_latency_seconds_sum", label, totals.latencyNanos[op] / 1e9);
+        appendSample(out, "operation_latency_seconds_count", label, (double)cumulative);
+    }
+    return out;
+}
+
+int IndexedDatabase::countRecords() const
+{
+    auto lock = readLock();
+    return index.getNodeCount();
+}
+
+int IndexedDatabase::getTreeHeight() const
+{
+    auto lock = readLock();
+    return index.getHeight(); // Every node already keeps its subtree height
+}
+
+int IndexedDatabase::getSearchComparisons(std::string_view key, int value)
+{
+    OperationStats stats;
+    search(key, value, &stats);
+    return stats.comparisons;
+}
+
+// ShardedDatabase Implementation
+namespace
+{
+    // Sums per-shard counts, where -1 from any shard (its log failed) makes the whole result -1
+    int addCounts(int total, int count)
+    {
+        return total < 0 || count < 0 ? -1 : total + count;
+    }
+
+    // One record of a shard's sorted result, with the fields the merge orders by copied while the shard was locked:
+    // after that a concurrent delete may free the record and its key bytes
+    struct ShardEntry
+    {
+        Record *record;
+        int value;
+        std::string key;
+    };
+
+    void addEntry(std::vector<ShardEntry> &part, const Record *record)
+    {
+        // The same pointer rangeQuery hands out; the visitor's const only keeps it read-only inside the lock
+        part.push_back({const_cast<Record *>(record), record->value, std::string(record->key)});
+    }
+}
+
+ShardedDatabase::ShardedDatabase(int shardCount)
+{
+    if (shardCount <= 0)
+        shardCount = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < shardCount; i++)
+        shards.emplace_back(new IndexedDatabase(true));
+}
+
+ShardedDatabase::ShardedDatabase(const std::vector<std::string> &splitKeys) : splitKeys(splitKeys)
+{
+    std::sort(this->splitKeys.begin(), this->splitKeys.end());
+    this->splitKeys.erase(std::unique(this->splitKeys.begin(), this->splitKeys.end()), this->splitKeys.end());
+    for (size_t i = 0; i <= this->splitKeys.size(); i++)
+        shards.emplace_back(new IndexedDatabase(true));
+}
+
+int ShardedDatabase::shardFor(std::string_view key) const
+{
+    if (!splitKeys.empty())
+        return (int)(std::upper_bound(splitKeys.begin(), splitKeys.end(), key) - splitKeys.begin());
+    return (int)(std::hash<std::string_view>()(key) % shards.size());
+}
+
+/*
+K-way merge of per-shard results that are each already sorted by less. The heap holds one candidate per shard,
+so merging n records from k shards costs O(n log k). Only the copied fields are compared, no shard lock is needed.
+*/
+template <typename Less>
+static std::vector<Record *> mergeShards(const std::vector<std::vector<ShardEntry>> &parts, Less less)
+{
+    std::vector<Record *> merged;
+    size_t total = 0;
+    for (const auto &part : parts)
+        total += part.size();
+    merged.reserve(total);
+
+    typedef std::pair<size_t, size_t> Head; // (part, position)
+    auto later = [&parts, &less](const Head &a, const Head &b)
+    { return less(parts[b.first][b.second], parts[a.first][a.second]); };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heap(later);
+    for (size_t i = 0; i < parts.size(); i++)
+        if (!parts[i].empty())
+            heap.push(Head(i, 0));
+    while (!heap.empty())
+    {
+        Head head = heap.top();
+        heap.pop();
+        merged.push_back(parts[head.first][head.second].record);
+        if (++head.second < parts[head.first].size())
+            heap.push(head);
+    }
+    return merged;
+}
+
+bool ShardedDatabase::insert(Record *record, OperationStats *stats)
+{
+    return shards[shardFor(record->key)]->insert(record, stats);
+}
+
+Record *ShardedDatabase::insert(std::string_view key, int value, OperationStats *stats)
+{
+    return shards[shardFor(key)]->insert(key, value, stats);
+}
+
+int ShardedDatabase::bulkLoad(const std::vector<std::pair<std::string, int>> &rows, bool parallel)
+{
+    std::vector<std::vector<std::pair<std::string, int>>> parts(shards.size());
+    for (const auto &row : rows)
+        parts[shardFor(row.first)].push_back(row);
+
+    int added = 0;
+    std::vector<std::future<int>> loads;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (parts[i].empty())
+            continue;
+        if (parallel)
+            loads.push_back(std::async(std::launch::async, [this, &parts, i]()
+                                       { return shards[i]->bulkLoad(parts[i]); }));
+        else
+            added = addCounts(added, shards[i]->bulkLoad(parts[i]));
+    }
+    for (auto &load : loads)
+        added = addCounts(added, load.get());
+    return added;
+}
+
+/*
+Ops keep their relative order within each shard, and every op on a key goes to the same shard, so the last op for a
+given (key, value) still wins
+*/
+int ShardedDatabase::applyBatch(const std::vector<BatchOp> &ops)
+{
+    std::vector<std::vector<BatchOp>> parts(shards.size());
+    for (const BatchOp &op : ops)
+        parts[shardFor(op.key)].push_back(op);
+    int changed = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+        if (!parts[i].empty())
+            changed = addCounts(changed, shards[i]->applyBatch(parts[i]));
+    return changed;
+}
+
+Record *ShardedDatabase::find(std::string_view key, int value, OperationStats *stats) const
+{
+    return shards[shardFor(key)]->find(key, value, stats);
+}
+
+bool ShardedDatabase::contains(std::string_view key, int value) const
+{
+    return shards[shardFor(key)]->contains(key, value);
+}
+
+std::vector<Record *> ShardedDatabase::searchAll(std::string_view key) const
+{
+    return shards[shardFor(key)]->searchAll(key);
+}
+
+/*
+Queries are grouped by shard so each shard answers its share as one batch under a single read lock
+*/
+std::vector<Record *> ShardedDatabase::multiSearch(const std::vector<std::pair<std::string, int>> &queries) const
+{
+    std::vector<std::vector<std::pair<std::string, int>>> parts(shards.size());
+    std::vector<std::vector<size_t>> positions(shards.size());
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        int target = shardFor(queries[i].first);
+        parts[target].push_back(queries[i]);
+        positions[target].push_back(i);
+    }
+
+    std::vector<Record *> results(queries.size(), nullptr);
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (parts[i].empty())
+            continue;
+        std::vector<Record *> found = shards[i]->multiSearch(parts[i]);
+        for (size_t j = 0; j < found.size(); j++)
+            results[positions[i][j]] = found[j];
+    }
+    return results;
+}
+
+bool ShardedDatabase::deleteRecord(std::string_view key, int value, OperationStats *stats)
+{
+    return shards[shardFor(key)]->deleteRecord(key, value, stats);
+}
+
+std::vector<Record *> ShardedDatabase::rangeQuery(int start, int end) const
+{
+    std::vector<std::vector<ShardEntry>> parts(shards.size());
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->forEachInRange(start, end, [&parts, i](const Record *record)
+                                  { addEntry(parts[i], record); });
+    return mergeShards(parts, [](const ShardEntry &a, const ShardEntry &b)
+                       { return a.value != b.value ? a.value < b.value : a.key < b.key; });
+}
+
+int ShardedDatabase::countRange(int start, int end) const
+{
+    int count = 0;
+    for (const auto &shard : shards)
+        count += shard->countRange(start, end);
+    return count;
+}
+
+/*
+With range partitioning only the shards whose key ranges overlap [low, high] are asked
+*/
+int ShardedDatabase::countKeyRange(std::string_view low, std::string_view high) const
+{
+    int first = 0, last = (int)shards.size() - 1;
+    if (!splitKeys.empty())
+    {
+        first = shardFor(low);
+        last = high < low ? first - 1 : shardFor(high);
+    }
+    int count = 0;
+    for (int i = first; i <= last; i++)
+        count += shards[i]->countKeyRange(low, high);
+    return count;
+}
+
+std::vector<Record *> ShardedDatabase::inorderTraversal() const
+{
+    if (!splitKeys.empty())
+    {
+        std::vector<Record *> result; // Shards already cover ascending key ranges, so they are chained without comparing
+        for (const auto &shard : shards)
+        {
+            std::vector<Record *> part = shard->inorderTraversal();
+            result.insert(result.end(), part.begin(), part.end());
+        }
+        return result;
+    }
+    std::vector<std::vector<ShardEntry>> parts(shards.size());
+    for (size_t i = 0; i < shards.size(); i++)
+        shards[i]->forEachRecord([&parts, i](const Record *record)
+                                 { addEntry(parts[i], record); });
+    return mergeShards(parts, [](const ShardEntry &a, const ShardEntry &b)
+                       { return a.key != b.key ? a.key < b.key : a.value < b.value; });
+}
+
+bool ShardedDatabase::clearDatabase()
+{
+    bool cleared = true;
+    for (auto &shard : shards)
+        cleared = shard->clearDatabase() && cleared; // The other shards are still cleared
+    return cleared;
+}
+
+int ShardedDatabase::countRecords() const
+{
+    int count = 0;
+    for (const auto &shard : shards)
+        count += shard->countRecords();
+    return count;
+}
+
+// RequestSession Implementation
+
+namespace
+{
+    bool parseInt(std::string_view text, int &value)
+    {
+        const char *last = text.data() + text.size();
+        auto parsed = std::from_chars(text.data() + (!text.empty() && text[0] == '+'), last, value);
+        return parsed.ec == std::errc() && parsed.ptr == last;
+    }
+
+    // Splits on spaces and tabs into at most tokens.size() words; returns how many there were
+    size_t splitWords(std::string_view line, std::array<std::string_view, 4> &tokens)
+    {
+        size_t count = 0, i = 0;
+        while (i < line.size())
+        {
+            while (i < line.size() && (line[i] == ' ' || line[i] == '\t'))
+                i++;
+            size_t start = i;
+            while (i < line.size() && line[i] != ' ' && line[i] != '\t')
+                i++;
+            if (i > start)
+            {
+                if (count == tokens.size())
+                    return count + 1; // Too many words for any command
+                tokens[count++] = line.substr(start, i - start);
+            }
+        }
+        return count;
+    }
+
+    void appendRecord(std::string &output, const Record *record)
+    {
+        output.append(record->key);
+        output += ' ';
+        output += std::to_string(record->value);
+        output += '\n';
+    }
+}
+
+RequestSession::RequestSession(IndexedDatabase &db) : db(db), closed(false) {}
+
+bool RequestSession::feed(const char *data, std::size_t length, std::string &output)
+{
+    if (closed)
+        return false;
+    input.append(data, length);
+    size_t start = 0;
+    while (!closed)
+    {
+        size_t end = input.find('\n', start);
+        if (end == std::string::npos)
+            break;
+        std::string_view line(input.data() + start, end - start);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        execute(line, output);
+        start = end + 1;
+    }
+    flushGets(output); // Runs never wait for the next read, whose arrival is up to the client
+    flushWrites(output);
+    input.erase(0, start);
+    if (!closed && input.size() > MaxLineBytes)
+    {
+        output += "ERR line too long\n";
+        closed = true;
+    }
+    return !closed;
+}
+
+void RequestSession::execute(std::string_view line, std::string &output)
+{
+    std::array<std::string_view, 4> words;
+    size_t count = splitWords(line, words);
+    if (count == 0)
+        return;
+
+    std::string_view command = words[0];
+    int first = 0, second = 0;
+    bool keyValue = count == 3 && parseInt(words[2], second);
+    if ((command == "GET" || command == "PUT" || command == "DEL") && keyValue)
+    {
+        if (command == "GET")
+        {
+            flushWrites(output); // The reads must see every earlier write from this connection
+            gets.emplace_back(std::string(words[1]), second);
+            if (gets.size() == MaxBatch)
+                flushGets(output);
+        }
+        else
+        {
+            flushGets(output);
+            writes.push_back(BatchOp{command == "PUT" ? BatchOp::Insert : BatchOp::Delete, std::string(words[1]), second});
+            if (writes.size() == MaxBatch)
+                flushWrites(output);
+        }
+        return;
+    }
+
+    flushGets(output);
+    flushWrites(output);
+    if (command == "RANGE" && count == 3 && parseInt(words[1], first) && parseInt(words[2], second))
+        runRange(first, second, output);
+    else if (command == "QUIT" && count == 1)
+    {
+        output += "BYE\n";
+        closed = true;
+    }
+    else if (command == "GET" || command == "PUT" || command == "DEL")
+        output += "ERR usage: " + std::string(command) + " key value\n";
+    else if (command == "RANGE")
+        output += "ERR usage: RANGE low high\n";
+    else
+        output += "ERR unknown command\n";
+}
+
+void RequestSession::flushGets(std::string &output)
+{
+    if (gets.empty())
+        return;
+    std::vector<Record *> found = db.multiSearch(gets); // Only compared with nullptr, so a concurrent delete is harmless
+    for (Record *record : found)
+        output += record ? "FOUND\n" : "NOT_FOUND\n";
+    gets.clear();
+}
+
+void RequestSession::flushWrites(std::string &output)
+{
+    if (writes.empty())
+        return;
+    bool logged = db.applyBatch(writes) >= 0; // A later write to the same record in the run wins, as it would one at a time
+    for (size_t i = 0; i < writes.size(); i++)
+        output += logged ? "OK\n" : "ERR log failed\n";
+    writes.clear();
+}
+
+void RequestSession::runRange(int start, int end, std::string &output)
+{
+    ReadSnapshot view = db.snapshot();
+    if (view.valid())
+    {
+        std::vector<Record *> records = view.rangeQuery(start, end);
+        output += "RANGE " + std::to_string(records.size()) + "\n";
+        for (const Record *record : records)
+            appendRecord(output, record); // view keeps them alive until it is released
+        return;
+    }
+    std::string lines;
+    size_t count = 0;
+    db.forEachInRange(start, end, [&](const Record *record)
+                      {
+        appendRecord(lines, record); // Formatted before the read lock is released, while no delete can free it
+        count++; });
+    output += "RANGE " + std::to_string(count) + "\n";
+    output += lines;
 }
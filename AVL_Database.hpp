@@ -2,79 +2,1158 @@
 #define AVL_DATABASE_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <new>
+#include <utility>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <thread>
 
+/*
+Object pool that carves fixed-size slots out of contiguous slabs.
+Destroyed objects go on a freelist and their slots are reused before a new slab is allocated,
+and releaseAll() drops every slab at once without visiting individual objects.
+*/
+template <typename T>
+class SlabPool {
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::vector<Slot*> slabs;  // Sorted by address so owns() can binary search
+    std::size_t slotsPerSlab;
+    Slot* freeList;
+    Slot* bump;                // Next never-used slot in the newest slab
+    Slot* bumpEnd;
+    std::size_t live;
+
+    Slot* allocateSlot() {
+        if (freeList) {
+            Slot* slot = freeList;
+            freeList = slot->next;
+            return slot;
+        }
+        if (bump == bumpEnd) {
+            Slot* slab = static_cast<Slot*>(::operator new(sizeof(Slot) * slotsPerSlab));
+            slabs.insert(std::upper_bound(slabs.begin(), slabs.end(), slab, std::less<Slot*>()), slab);
+            bump = slab;
+            bumpEnd = slab + slotsPerSlab;
+        }
+        return bump++;
+    }
+
+public:
+    explicit SlabPool(std::size_t slots = 1024)
+        : slotsPerSlab(slots ? slots : 1), freeList(nullptr), bump(nullptr), bumpEnd(nullptr), live(0) {}
+    ~SlabPool() { releaseAll(); }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        Slot* slot = allocateSlot();
+        T* object = new (slot->storage) T(std::forward<Args>(args)...);
+        live++;
+        return object;
+    }
+
+    void destroy(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = freeList;
+        freeList = slot;
+        live--;
+    }
+
+    // Frees all slabs without running destructors; callers destroy non-trivial objects first
+    void releaseAll() {
+        for (Slot* slab : slabs)
+            ::operator delete(slab);
+        slabs.clear();
+        freeList = bump = bumpEnd = nullptr;
+        live = 0;
+    }
+
+    bool owns(const T* object) const {
+        const Slot* slot = reinterpret_cast<const Slot*>(object);
+        auto it = std::upper_bound(slabs.begin(), slabs.end(), slot, std::less<const Slot*>());
+        if (it == slabs.begin())
+            return false;
+        --it;
+        return std::less<const Slot*>()(slot, *it + slotsPerSlab);
+    }
+
+    std::size_t liveCount() const { return live; }
+    std::size_t slabCount() const { return slabs.size(); }
+    std::size_t capacity() const { return slabs.size() * slotsPerSlab; }
+};
+
+/*
+Key bytes for the records a database creates itself, carved out of large chunks instead of one heap block per key.
+Each stored key sits behind a 32-bit reference count so records with equal keys can share one copy. Released keys go
+on a free list for their size class and are reused by later keys of that size; keys too long for any class get a
+block of their own.
+*/
+class KeyArena {
+private:
+    static const std::size_t ChunkBytes = 64 * 1024;
+    static const std::size_t Granularity = 8;
+    static const std::size_t MaxPooledBytes = 512;  // Blocks (count included) above this bypass the chunks
+
+    std::vector<char*> chunks;
+    char* bump;
+    char* bumpEnd;
+    char* freeLists[MaxPooledBytes / Granularity + 1];  // Intrusive: a free block starts with the next one's address
+    std::vector<char*> largeBlocks;                     // Sorted, so release can binary search
+    std::size_t liveKeys;
+    std::size_t liveBytes;
+
+    static std::size_t blockBytes(std::size_t length) {
+        return (sizeof(std::uint32_t) + length + Granularity - 1) / Granularity * Granularity;
+    }
+
+public:
+    KeyArena();
+    ~KeyArena() { releaseAll(); }
+    KeyArena(const KeyArena&) = delete;
+    KeyArena& operator=(const KeyArena&) = delete;
+
+    std::string_view store(std::string_view key);     // A new copy holding one reference
+    std::string_view share(std::string_view stored);  // One more reference to a key returned by store
+    void release(std::string_view stored);            // Drops a reference, the last one frees the bytes
+    void releaseAll();
+
+    std::size_t keyCount() const { return liveKeys; }
+    std::size_t bytesInUse() const { return liveBytes; }
+    std::size_t bytesReserved() const { return chunks.size() * ChunkBytes; }
+};
+
+/*
+What a single lookup, insert or delete cost on the tree it ran against
+*/
+struct OperationStats {
+    int comparisons = 0;  // Three-way key comparisons made during the descent
+    int depth = 0;        // Depth of the matched (or newly linked) node, or how far a miss descended
+    int rotations = 0;    // Single rotations performed while rebalancing
+};
+
+/*
+Process-wide counters kept per thread: each thread only ever writes its own block (relaxed atomics, no contention),
+and totals() sums the blocks of every live thread plus whatever exited threads left behind.
+*/
+class OperationCounters {
+public:
+    enum TimedOp { TimedInsert, TimedFind, TimedDelete, TimedRange, TimedOps };
+    static const int LatencyBuckets = 32;  // Bucket b counts latencies in [2^(b-1), 2^b) ns, the last one is open-ended
+
+    struct Totals {
+        unsigned long long searches = 0;
+        unsigned long long inserts = 0;
+        unsigned long long deletes = 0;
+        unsigned long long comparisons = 0;
+        unsigned long long rotations = 0;
+        unsigned long long cacheHits = 0;    // Point lookups answered by a HotKeyCache
+        unsigned long long cacheMisses = 0;  // Point lookups that went on to the index behind a HotKeyCache
+        unsigned long long latency[TimedOps][LatencyBuckets] = {};  // Sampled calls on databases with latency tracking on
+        unsigned long long latencyNanos[TimedOps] = {};             // Sum of the sampled latencies
+    };
+
+    static Totals totals();
+    static Totals thisThread();
+
+    static void addSearch(int count = 1);
+    static void addInsert(int count = 1);
+    static void addDelete(int count = 1);
+    static void addComparisons(int count);
+    static void addRotation();
+    static void addCacheHit();
+    static void addCacheMiss();
+    static void addLatency(TimedOp op, unsigned long long nanos);
+    static unsigned long long threadRotations();
+};
+
+/*
+Records built by callers copy their key into memory they own. Records a database creates itself borrow their key
+from its KeyArena instead (copyKey false, so ownsKey is false), and the database returns the bytes when it frees them.
+*/
 class Record {
 public:
-    std::string key;
+    std::string_view key;
     int value;
-    
-    Record(const std::string& k, int v);
+    bool ownsKey;
+
+    Record(std::string_view k, int v, bool copyKey = true);
+    ~Record();
+    Record(const Record&) = delete;
+    Record& operator=(const Record&) = delete;
 };
 
+/*
+Laid out so a comparison normally resolves from the node itself: the value and the first KeyPrefixBytes of the key
+are copied inline (the whole key when it is that short), and the record is only dereferenced for long keys that
+share the inline prefix. The subtree size fills what would otherwise be padding, so nodes stay 48 bytes on 64-bit targets.
+Value-ordered trees only look at keys to break ties between equal values, so they read those from the record and keep
+the subtree's value sum in the prefix bytes instead.
+*/
 class AVLNode {
 public:
-    Record* record;
+    static const int KeyPrefixBytes = 14;
+    static const int SumOffset = 4;     // Puts the sum on an 8-byte boundary inside keyPrefix
+
     AVLNode* left;
     AVLNode* right;
-    int height;
+    int value;                          // Copy of record->value
+    char keyPrefix[KeyPrefixBytes];     // First bytes of record->key
+    std::uint8_t keyLength;             // record->key length, saturated at 255
+    std::int8_t height;                 // AVL heights stay far below 127
+    std::int32_t size;                  // Nodes in this subtree, for rank and select
+    Record* record;
     
     AVLNode(Record* r);
+    void setRecord(Record* r);          // Points the node at r and refreshes the inline copies
+    int compareKey(std::string_view key) const;  // Key-ordered trees only
+    // Values in this subtree, value-ordered trees only
+    std::int64_t sum() const {
+        std::int64_t total;
+        std::memcpy(&total, keyPrefix + SumOffset, sizeof(total));
+        return total;
+    }
+    void setSum(std::int64_t total) { std::memcpy(keyPrefix + SumOffset, &total, sizeof(total)); }
+    int compareKeyFrom(std::string_view key, std::size_t known, std::size_t& common) const;
+};
+
+/*
+Depth and balance of a tree's nodes, from AVLTree::shape: exact, or estimated from evenly spaced ranks
+*/
+struct TreeShape {
+    int height = 0;
+    double averageDepth = 0;               // The root is at depth 1
+    std::array<std::size_t, 3> balance{};  // Nodes whose left minus right subtree height is -1, 0 and +1
+    std::size_t sampled = 0;               // Nodes averageDepth and balance were measured on
 };
 
 class AVLTree {
+public:
+    enum class Ordering {
+        ByKey,    // records ordered by key, ties broken by value (primary index)
+        ByValue   // records ordered by value, ties broken by key (secondary index)
+    };
+
+    static const int MaxHeight = 64;  // AVL height stays below 1.45 log2(n + 2), far under this for any int node count
+    static const int ParallelBuildThreshold = 1 << 14;  // Smaller subtrees are built on the calling thread
+    static const int ParallelSetHeight = 15;  // Shorter subtrees (under about 2^14 nodes) are merged on the calling thread
+    static const int BatchWidth = 16;  // Lookups findBatch keeps in flight at once
+    static const int ParallelScanThreshold = 1 << 15;  // Fewest records worth handing a scan task to another thread
+
 private:
     AVLNode* root;
     int nodeCount;
-    mutable int searchComparisonCount;  // For measuring search complexity
+    Ordering ordering;
+    std::vector<std::shared_ptr<SlabPool<AVLNode>>> pools;  // pools[0] allocates, the rest came with nodes moved in from other trees
     
     int height(AVLNode* node);
+    static int size(const AVLNode* node);
+    static std::int64_t subtreeSum(const AVLNode* node);
     int getBalance(AVLNode* node);
     void updateHeight(AVLNode* node);
     
     AVLNode* rotateRight(AVLNode* y);
     AVLNode* rotateLeft(AVLNode* x);
     
-    AVLNode* insertHelper(AVLNode* node, Record* record);
+    int compare(std::string_view key, int value, const Record* record) const;
+    int compare(std::string_view key, int value, const AVLNode* node) const;
+    int compareFrom(std::string_view key, int value, const AVLNode* node, std::size_t known, std::size_t& common) const;
     AVLNode* reBalance(AVLNode* node);  
-    AVLNode* deleteHelper(AVLNode* root, AVLNode* child) const;
-    AVLNode* searchHelper(AVLNode* node, const std::string& key, int value) const;
-    AVLNode* minValueNode(AVLNode* node);
+    void rebalancePath(AVLNode** path[], int depth);
+    AVLNode* buildBalanced(AVLNode** nodes, int count, int parallelDepth);
+    void buildFromSorted(const std::vector<Record*>& sorted, bool parallel);
+    AVLNode* searchHelper(AVLNode* node, std::string_view key, int value, OperationStats* stats = nullptr) const;
+    void reset();
+    AVLNode* createNode(Record* record) {
+        AVLNode* node = pools[0]->create(record);
+        if (ordering == Ordering::ByValue)
+            node->setSum(node->value);
+        return node;
+    }
+    void destroyNode(AVLNode* node);
+    AVLNode* release(std::vector<std::shared_ptr<SlabPool<AVLNode>>>& kept);
+    void adoptPools(const std::vector<std::shared_ptr<SlabPool<AVLNode>>>& adopted);
+
+    // Split/join primitives, all O(log n), and the batch merges and set operations built on them
+    AVLNode* join(AVLNode* left, AVLNode* pivot, AVLNode* right);
+    AVLNode* joinRight(AVLNode* left, AVLNode* pivot, AVLNode* right);
+    AVLNode* joinLeft(AVLNode* left, AVLNode* pivot, AVLNode* right);
+    AVLNode* join2(AVLNode* left, AVLNode* right);
+    AVLNode* removeMin(AVLNode* node, AVLNode*& min);
+    void split(AVLNode* node, std::string_view key, int value, AVLNode*& less, AVLNode*& match, AVLNode*& greater);
+    AVLNode* unionSorted(AVLNode* tree, AVLNode** nodes, int count, std::vector<AVLNode*>& rejected);
+    template <typename Item>
+    AVLNode* differenceSorted(AVLNode* tree, Item* const* items, int count, std::vector<AVLNode*>& removed);
+    int insertSorted(const std::vector<Record*>& sorted, std::vector<Record*>& rejected);
+    template <typename Item>
+    void eraseSorted(const std::vector<Item*>& sorted, std::vector<Record*>& removed);
+    AVLNode* unionTrees(AVLNode* tree, AVLNode* other, int parallelDepth, std::vector<AVLNode*>& dropped);
+    AVLNode* intersectTrees(AVLNode* tree, const AVLNode* other, int parallelDepth, std::vector<AVLNode*>& dropped);
+    AVLNode* differenceTrees(AVLNode* tree, const AVLNode* other, int parallelDepth, std::vector<AVLNode*>& dropped);
+    void collectNodes(AVLNode* node, std::vector<AVLNode*>& nodes) const;
+    int countBefore(std::string_view key, int value, bool inclusive) const;
+    std::int64_t sumBefore(std::string_view key, int value, bool inclusive) const;  // Sum of record values countBefore counts, ByValue only
+    template <typename Visit>
+    static void forEachRank(const AVLNode* node, int from, int to, Visit& visit);  // In order, ranks in [from, to)
     
     friend class IndexedDatabase;
+    friend class AVLCursor;
 
 public:
-    AVLTree();
-    void insert(Record* record);
-    Record* search(const std::string& key, int value);
-    void deleteNode(const std::string& key, int value);
+    explicit AVLTree(Ordering order = Ordering::ByKey);
+    bool insert(Record* record, OperationStats* stats = nullptr);
+    Record* search(std::string_view key, int value, OperationStats* stats = nullptr);
+    Record* find(std::string_view key, int value, OperationStats* stats = nullptr) const;
+    void findBatch(const std::pair<std::string, int>* queries, std::size_t count, Record** results) const;
+    bool contains(std::string_view key, int value) const { return find(key, value) != nullptr; }
+    Record* deleteNode(std::string_view key, int value, OperationStats* stats = nullptr);
     int getNodeCount() const { return nodeCount; }
-    int getLastSearchComparisons() const { return searchComparisonCount; }
+
+    // Order statistics in O(log n) from the subtree sizes kept in every node
+    int rank(std::string_view key, int value) const;    // Records ordered before (key, value)
+    Record* select(int i) const;                       // 0-based, nullptr when out of range
+    int countRange(std::string_view lowKey, int lowValue, std::string_view highKey, int highValue) const;
+
+    // Telemetry: samples == 0 (or at least the node count) visits every node, otherwise O(samples log n)
+    TreeShape shape(int samples = 0) const;
+    int getHeight() const { return root ? root->height : 0; }
+    std::size_t slabBytes() const;  // Bytes of every node slab this tree holds, adopted ones included
+
+    // Whole-tree operations for trees with the same ordering. Nodes are moved between trees, never copied,
+    // and records are never freed: the set operations return the records they unlinked to the caller.
+    void join(AVLTree& left, Record* pivot, AVLTree& right);  // left < pivot < right, both end up empty
+    void split(std::string_view key, int value, AVLTree& upper);  // Moves records at or after (key, value) into upper
+    std::vector<Record*> unionWith(AVLTree& other, bool parallel = false);  // Empties other, returns its duplicates
+    std::vector<Record*> intersect(const AVLTree& other, bool parallel = false);
+    std::vector<Record*> difference(const AVLTree& other, bool parallel = false);
+};
+
+/*
+Lazy, bidirectional position in an AVLTree's order. Keeps the root-to-current path on an explicit stack,
+so it needs O(h) memory and each step is amortized O(1). Any insert or delete on the tree invalidates it.
+*/
+class AVLCursor {
+private:
+    const AVLTree* tree;
+    AVLNode* path[AVLTree::MaxHeight];
+    int depth;  // 0 means the cursor is past either end
+
+public:
+    explicit AVLCursor(const AVLTree& t) : tree(&t), depth(0) {}
+
+    void seekFirst();
+    void seekLast();
+    // Moves to the first record at or after (key, value) in the tree's ordering
+    void seek(std::string_view key, int value = std::numeric_limits<int>::min());
+    void next();
+    void prev();
+
+    bool valid() const { return depth > 0; }
+    Record* record() const { return depth > 0 ? path[depth - 1]->record : nullptr; }
+};
+
+/*
+Keys that are fixed-width byte strings; std::less orders them exactly like memcmp
+*/
+template <typename T> struct IsByteArray : std::false_type {};
+template <std::size_t N> struct IsByteArray<std::array<unsigned char, N>> : std::true_type {};
+
+/*
+Ordered map on an AVL tree that is generic over key, value and comparator, for tables that need neither Record pointers
+nor string keys. Keys and values are stored by value in the node. Under the default comparator the three-way comparison
+is picked at compile time: integral keys use a branchless (a > b) - (a < b), byte arrays memcmp, strings and string
+views their own compare(), and anything else two calls of Compare. Like AVLTree, insert and erase descend once and
+rebalance the recorded path bottom-up, and nodes come from a SlabPool.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class AVLMap {
+private:
+    struct Node {
+        Key key;
+        Value value;
+        int height;      // Next to the value, so small keys and values pack with it into 16 bytes
+        Node* child[2];  // child[1] is the right subtree, so descents index by the comparison instead of branching
+
+        Node(const Key& k, const Value& v) : key(k), value(v), height(1), child{nullptr, nullptr} {}
+    };
+
+    static const int MaxHeight = 64;
+    static constexpr bool DefaultOrder = std::is_same<Compare, std::less<Key>>::value;
+
+    Node* root;
+    int nodeCount;
+    Compare less;
+    SlabPool<Node> pool;
+
+    int compare(const Key& a, const Key& b) const {
+        if constexpr (DefaultOrder && std::is_integral<Key>::value)
+            return (a > b) - (a < b);
+        else if constexpr (DefaultOrder && IsByteArray<Key>::value)
+            return std::memcmp(a.data(), b.data(), a.size());
+        else if constexpr (DefaultOrder && (std::is_same<Key, std::string>::value || std::is_same<Key, std::string_view>::value))
+            return a.compare(b);
+        else
+            return less(a, b) ? -1 : (less(b, a) ? 1 : 0);
+    }
+
+    static int heightOf(const Node* node) { return node ? node->height : 0; }
+
+    static void update(Node* node) {
+        node->height = 1 + std::max(heightOf(node->child[0]), heightOf(node->child[1]));
+    }
+
+    // Lifts node->child[side] into node's place
+    static Node* rotate(Node* node, int side) {
+        Node* up = node->child[side];
+        node->child[side] = up->child[!side];
+        up->child[!side] = node;
+        update(node);
+        update(up);
+        return up;
+    }
+
+    static Node* rebalance(Node* node) {
+        update(node);
+        int balance = heightOf(node->child[0]) - heightOf(node->child[1]);
+        if (balance >= -1 && balance <= 1)
+            return node;
+        int side = balance < 0;  // The taller side
+        Node* tall = node->child[side];
+        if (heightOf(tall->child[!side]) > heightOf(tall->child[side]))
+            node->child[side] = rotate(tall, !side);  // Zig-zag: straighten it into a line first
+        return rotate(node, side);
+    }
+
+    static void rebalancePath(Node** path[], int depth) {
+        while (depth > 0) {
+            Node** link = path[--depth];
+            *link = rebalance(*link);
+        }
+    }
+
+    // Finds key's link, recording the links above it; returns the link that holds key or the null link it belongs in
+    Node** descend(const Key& key, Node** path[], int& depth) {
+        Node** link = &root;
+        while (*link) {
+            int cmp = compare(key, (*link)->key);
+            if (cmp == 0)
+                break;
+            path[depth++] = link;
+            link = &(*link)->child[cmp > 0];
+        }
+        return link;
+    }
+
+    const Node* findNode(const Key& key) const {
+        const Node* node = root;
+        while (node) {
+            int cmp = compare(key, node->key);
+            if (cmp == 0)
+                return node;
+            node = node->child[cmp > 0];
+        }
+        return nullptr;
+    }
+
+    void destroyAll(Node* node) {
+        if (!node)
+            return;
+        destroyAll(node->child[0]);
+        destroyAll(node->child[1]);
+        pool.destroy(node);
+    }
+
+public:
+    explicit AVLMap(const Compare& order = Compare()) : root(nullptr), nodeCount(0), less(order), pool(1024) {}
+    ~AVLMap() { clear(); }
+    AVLMap(const AVLMap&) = delete;
+    AVLMap& operator=(const AVLMap&) = delete;
+
+    // Returns false, leaving the stored value alone, if key is already present
+    bool insert(const Key& key, const Value& value) {
+        Node** path[MaxHeight];
+        int depth = 0;
+        Node** link = descend(key, path, depth);
+        if (*link)
+            return false;
+        *link = pool.create(key, value);
+        nodeCount++;
+        rebalancePath(path, depth);
+        return true;
+    }
+
+    // Returns true if key was new, otherwise overwrites its value
+    bool insertOrAssign(const Key& key, const Value& value) {
+        Node** path[MaxHeight];
+        int depth = 0;
+        Node** link = descend(key, path, depth);
+        if (*link) {
+            (*link)->value = value;
+            return false;
+        }
+        *link = pool.create(key, value);
+        nodeCount++;
+        rebalancePath(path, depth);
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        Node** path[MaxHeight];
+        int depth = 0;
+        Node** link = descend(key, path, depth);
+        Node* target = *link;
+        if (!target)
+            return false;
+        if (!target->child[0] || !target->child[1]) {
+            *link = target->child[target->child[0] == nullptr];  // Whichever child exists, or null
+            pool.destroy(target);
+        } else {
+            path[depth++] = link;  // Two children: the in-order successor's key and value move up into target
+            Node** successor = &target->child[1];
+            while ((*successor)->child[0]) {
+                path[depth++] = successor;
+                successor = &(*successor)->child[0];
+            }
+            Node* next = *successor;
+            target->key = std::move(next->key);
+            target->value = std::move(next->value);
+            *successor = next->child[1];
+            pool.destroy(next);
+        }
+        nodeCount--;
+        rebalancePath(path, depth);
+        return true;
+    }
+
+    Value* find(const Key& key) { return const_cast<Value*>(static_cast<const AVLMap*>(this)->find(key)); }
+    const Value* find(const Key& key) const {
+        const Node* node = findNode(key);
+        return node ? &node->value : nullptr;
+    }
+    bool contains(const Key& key) const { return findNode(key) != nullptr; }
+
+    // Calls fn(key, value) for every entry with low <= key <= high, in key order, touching O(log n + k) nodes
+    template <typename Fn>
+    void forEachInRange(const Key& low, const Key& high, Fn fn) const {
+        const Node* stack[MaxHeight];
+        int depth = 0;
+        const Node* node = root;
+        for (;;) {
+            while (node) {
+                if (compare(node->key, low) < 0) {
+                    node = node->child[1];
+                } else {
+                    stack[depth++] = node;
+                    node = node->child[0];
+                }
+            }
+            if (depth == 0)
+                return;
+            node = stack[--depth];
+            if (compare(node->key, high) > 0)
+                return;
+            fn(node->key, node->value);
+            node = node->child[1];
+        }
+    }
+
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        const Node* stack[MaxHeight];
+        int depth = 0;
+        const Node* node = root;
+        while (node || depth > 0) {
+            for (; node; node = node->child[0])
+                stack[depth++] = node;
+            node = stack[--depth];
+            fn(node->key, node->value);
+            node = node->child[1];
+        }
+    }
+
+    void clear() {
+        if constexpr (!std::is_trivially_destructible<Node>::value)
+            destroyAll(root);  // Keys or values own memory, so each node is destroyed before the slabs go
+        pool.releaseAll();
+        root = nullptr;
+        nodeCount = 0;
+    }
+
+    int size() const { return nodeCount; }
+    bool empty() const { return nodeCount == 0; }
+    int height() const { return heightOf(root); }
+};
+
+/*
+Immutable, read-optimized copy of a key index in Eytzinger (breadth-first) order: the root is slot 1 and the children
+of slot k are 2k and 2k + 1, so a descent walks forward through one array and the next levels can be prefetched.
+Entries hold no pointers, keys live in one contiguous buffer, and only the matched entry's Record is looked up.
+Deleting a frozen record only clears its Record slot.
+*/
+class FrozenIndex {
+public:
+    static const int KeyPrefixBytes = 20;
+
+    struct alignas(32) Entry {
+        char keyPrefix[KeyPrefixBytes];
+        std::uint32_t keyLength;
+        std::uint32_t keyOffset;   // Full key bytes in keyBytes
+        int value;
+    };
+
+private:
+    std::vector<Entry> entries;     // entries[0] is unused
+    std::vector<Record*> records;   // Parallel to entries, nullptr once deleted
+    std::vector<char> keyBytes;
+    int liveCount;
+
+    void layout(const std::vector<Record*>& sorted, std::size_t& next, std::size_t slot);
+    int compare(std::string_view key, int value, const Entry& entry) const;
+
+public:
+    explicit FrozenIndex(const std::vector<Record*>& sorted);  // Records in (key, value) order
+    Record* find(std::string_view key, int value, OperationStats* stats = nullptr) const;
+    bool erase(std::string_view key, int value);
+    int size() const { return (int)entries.size() - 1; }
+    std::size_t memoryBytes() const {
+        return entries.capacity() * sizeof(Entry) + records.capacity() * sizeof(Record*) + keyBytes.capacity();
+    }
+    int liveRecords() const { return liveCount; }
+};
+
+/*
+Open-addressing (linear probing) hash of records by (key, value), for exact-match lookups in O(1) expected time.
+Each slot keeps the full hash next to the record pointer, so a probe only touches the record once the hashes agree,
+and deletes shift the following run back instead of leaving tombstones. The table stays at most 3/4 full.
+*/
+class HashIndex {
+private:
+    struct Slot {
+        std::uint64_t hash;
+        Record* record;  // nullptr marks an empty slot
+    };
+
+    std::vector<Slot> slots;
+    std::size_t count;
+    std::size_t mask;
+
+    void rehash(std::size_t capacity);
+
+public:
+    explicit HashIndex(std::size_t expected = 0);
+
+    static std::uint64_t hashOf(std::string_view key, int value);  // Also keys the HotKeyCache
+
+    bool insert(Record* record);  // false if a record with the same key and value is already present
+    Record* find(std::string_view key, int value, OperationStats* stats = nullptr) const;
+    void findBatch(const std::pair<std::string, int>* queries, std::size_t count, Record** results) const;
+    Record* erase(std::string_view key, int value);
+    void reserve(std::size_t expected);
+    void clear();
+
+    std::size_t size() const { return count; }
+    std::size_t memoryBytes() const { return slots.size() * sizeof(Slot); }
+};
+
+/*
+Small, fixed-size cache of recently found records in front of the point lookup path, so hot keys of a skewed
+workload skip the descent. Records hash to a set of four entries that is replaced with CLOCK: a hit sets the entry's
+reference bit, and a record found in the index takes the first entry whose bit is clear, clearing bits it passes.
+Missing keys are never cached. Entries are atomics, so readers sharing the database's read lock hit and fill it
+concurrently; writers forget a record under the write lock before it is freed, so a cached pointer is always live.
+*/
+class HotKeyCache {
+private:
+    static const int Ways = 4;
+
+    struct alignas(64) Set {
+        std::atomic<Record*> records[Ways];
+        std::atomic<std::uint32_t> tags[Ways];  // High hash bits, checked before touching the record
+        std::atomic<std::uint8_t> referenced[Ways];
+        std::atomic<std::uint8_t> hand;         // Where the next replacement starts looking
+    };
+
+    std::unique_ptr<Set[]> sets;
+    std::size_t mask;
+
+public:
+    explicit HotKeyCache(std::size_t entries);  // Rounded up to a power of two of at least Ways
+
+    Record* find(std::string_view key, int value, std::uint64_t hash);  // hash is HashIndex::hashOf(key, value)
+    void remember(Record* record, std::uint64_t hash);  // After the index found it
+    void forget(const Record* record);                   // Before the record is freed
+    void clear();
+
+    std::size_t capacity() const { return (mask + 1) * Ways; }
+    std::size_t memoryBytes() const { return (mask + 1) * sizeof(Set); }
+};
+
+/*
+Persistent (path-copying) copies of both orderings, for reads that take no lock. A published node is never changed:
+each write copies the nodes on its path, and publish() installs the new roots with one atomic store, so a reader keeps
+walking whichever version it loaded. Readers pin the current epoch while they hold a version; nodes and records that
+a write replaced are freed only once every reader pinned before that write has let go.
+Everything except pin, current and unpin belongs to the single writer (IndexedDatabase calls it under its write lock).
+*/
+class VersionStore {
+public:
+    struct Node {
+        const Node* left;
+        const Node* right;
+        Record* record;
+        int value;                 // Copy of record->value, so the value ordering rarely touches the record
+        int height;
+        int size;
+        std::uint64_t generation;  // Nodes of the writer's current generation are unpublished and change in place
+    };
+
+    struct Version {
+        const Node* byKey;    // (key, value) order
+        const Node* byValue;  // (value, key) order
+    };
+
+private:
+    static const int ReaderSlots = 128;
+    static const std::size_t ReclaimBatch = 32;  // Publishes between scans of the reader slots
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<std::uint64_t> epoch;  // 0 while free, else the epoch its reader pinned
+    };
+
+    struct Retired {
+        std::uint64_t epoch;  // Still visible to readers that pinned this epoch or an earlier one
+        const Version* version;
+        std::size_t nodes;    // How many of the oldest retiredNodes and retiredRecords belong to this publish
+        std::size_t records;
+    };
+
+    std::atomic<const Version*> published;
+    mutable std::atomic<std::uint64_t> epoch;
+    mutable ReaderSlot slots[ReaderSlots];
+
+    const Node* keyRoot;    // Working roots, published by the next publish()
+    const Node* valueRoot;
+    std::uint64_t generation;
+    SlabPool<Node> nodes;
+    SlabPool<Version> versions;
+    std::deque<const Node*> retiredNodes;    // Replaced by a write but maybe still reachable from older versions, oldest first
+    std::deque<Record*> retiredRecords;
+    std::size_t pendingNodes;                // Tail of retiredNodes and retiredRecords not yet covered by a publish
+    std::size_t pendingRecords;
+    std::deque<Retired> retired;             // One entry per publish, oldest first
+
+    Node* makeNode(Record* record);
+    Node* own(const Node* node);
+    void drop(const Node* node);
+    void dropTree(const Node* node, bool records);
+    static int compare(const Record* record, const Node* node, bool byValue);
+    static int height(const Node* node) { return node ? node->height : 0; }
+    static int sizeOf(const Node* node) { return node ? node->size : 0; }
+    static void update(Node* node);
+    Node* rotateLeft(Node* node);
+    Node* rotateRight(Node* node);
+    Node* balance(Node* node);
+    const Node* insertInto(const Node* node, Record* record, bool byValue);
+    const Node* eraseFrom(const Node* node, const Record* record, bool byValue);
+    const Node* removeMin(const Node* node, Record*& min);
+    const Node* build(const std::vector<Record*>& sorted, std::size_t begin, std::size_t end);
+    void reclaim(std::vector<Record*>& freed);
+
+public:
+    VersionStore();
+    VersionStore(const VersionStore&) = delete;
+    VersionStore& operator=(const VersionStore&) = delete;
+
+    // Writer side: changes stay invisible until publish()
+    void insert(Record* record);
+    void erase(const Record* record);
+    void rebuild(const std::vector<Record*>& byKey, const std::vector<Record*>& byValue);
+    void clear();                           // Retires every record as well as every node
+    void retire(Record* record);            // Freed once no reader can still reach it
+    void publish(std::vector<Record*>& freed);  // freed receives the retired records that are now safe to destroy
+    std::vector<Record*> drain();           // Every retired record, regardless of readers; only for teardown
+    std::size_t retiredCount() const;       // Nodes and records waiting for readers to move on
+    std::size_t memoryBytes() const { return nodes.liveCount() * sizeof(Node) + versions.liveCount() * sizeof(Version); }
+
+    // Reader side, safe from any thread
+    const Version* pin(int& slot) const;
+    void unpin(int slot) const;
+};
+
+/*
+A consistent, read-only view of an IndexedDatabase taken by snapshot(). Taking and reading it takes no lock and never
+blocks writers; returned Record pointers stay valid for as long as the snapshot is held, even if they are deleted.
+*/
+class ReadSnapshot {
+private:
+    const VersionStore* store;
+    const VersionStore::Version* version;
+    int slot;
+
+    void release();
+
+public:
+    ReadSnapshot() : store(nullptr), version(nullptr), slot(-1) {}  // Empty view, for databases without versioning
+    explicit ReadSnapshot(const VersionStore* store);
+    ~ReadSnapshot() { release(); }
+    ReadSnapshot(ReadSnapshot&& other) noexcept;
+    ReadSnapshot& operator=(ReadSnapshot&& other) noexcept;
+    ReadSnapshot(const ReadSnapshot&) = delete;
+    ReadSnapshot& operator=(const ReadSnapshot&) = delete;
+
+    bool valid() const { return version != nullptr; }
+    Record* find(std::string_view key, int value) const;
+    bool contains(std::string_view key, int value) const { return find(key, value) != nullptr; }
+    std::vector<Record*> rangeQuery(int start, int end) const;  // (value, key) order, like IndexedDatabase::rangeQuery
+    int countRange(int start, int end) const;
+    std::vector<Record*> inorderTraversal() const;              // (key, value) order
+    int countRecords() const;
+};
+
+/*
+Count, sum, min and max of the values in a value range, from IndexedDatabase::aggregate
+*/
+struct RangeAggregate {
+    long long count = 0;
+    long long sum = 0;
+    int min = std::numeric_limits<int>::max();  // Only meaningful when count > 0
+    int max = std::numeric_limits<int>::min();
+};
+
+/*
+Memory and shape of one IndexedDatabase at a point in time, from IndexedDatabase::stats. Byte counts cover what the
+database allocated itself: records a caller built with new Record, and their keys, are not included.
+*/
+struct DatabaseStats {
+    std::size_t records = 0;
+    std::size_t nodeBytes = 0;         // Live nodes of both indexes
+    std::size_t nodeSlabBytes = 0;     // Slabs reserved for them
+    std::size_t recordBytes = 0;       // Live records from the record pool
+    std::size_t recordSlabBytes = 0;
+    std::size_t keyBytes = 0;          // Key blocks in the arena, counts and padding included
+    std::size_t keyArenaBytes = 0;     // Arena chunks reserved for short keys
+    std::size_t hashIndexBytes = 0;
+    std::size_t hotCacheBytes = 0;
+    std::size_t frozenBytes = 0;       // Frozen snapshot plus its delta tree's nodes
+    std::size_t versionBytes = 0;      // Persistent nodes, those kept only for snapshot readers included
+    TreeShape keyIndex;                // Shape of the primary index
+};
+
+/*
+One write in an IndexedDatabase::applyBatch call
+*/
+struct BatchOp {
+    enum Kind { Insert, Delete };
+
+    Kind kind;
+    std::string key;
+    int value;
+};
+
+/*
+Group commit settings for a WriteAheadLog. A group is written and synced once its first record has waited
+groupCommitMicros or it has grown to groupCommitBytes, whichever comes first.
+*/
+struct WalOptions {
+    int groupCommitMicros = 500;
+    std::size_t groupCommitBytes = 1 << 20;
+    bool waitForDurable = true;  // Writers block until their group is synced; false acknowledges them at once
+};
+
+/*
+Append-only redo log. append() only copies the record into the open group, a background thread writes and syncs
+whole groups, so many writers share each sync. Every record carries its own checksum, and replay stops at the first
+torn or damaged one, which is where a crash mid-write leaves the log.
+*/
+class WriteAheadLog {
+public:
+    enum Op : std::uint8_t { Insert = 1, Delete = 2, Clear = 3 };
+
+private:
+    std::FILE* file;
+    WalOptions options;
+    std::mutex mutex;
+    std::condition_variable wake;      // Signals the flusher: records arrived, a flush was asked for, or close()
+    std::condition_variable synced;    // Signals writers each time a group reaches disk
+    std::vector<char> pending;         // The open group
+    std::uint64_t appended;            // Sequence number of the last appended record
+    std::uint64_t durable;             // Sequence number of the last synced record
+    bool flushRequested;
+    bool stopping;
+    std::atomic<bool> failed;          // Set for good once a group could not be written or synced
+    std::thread flusher;
+
+    void flusherLoop();
+    bool writeGroup(const std::vector<char>& group);
+
+public:
+    WriteAheadLog();
+    ~WriteAheadLog();
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    bool open(const std::string& path, const WalOptions& options = WalOptions());
+    void close();
+    bool isOpen() const { return file != nullptr; }
+    bool waitsForDurable() const { return options.waitForDurable; }
+    bool hasFailed() const { return failed.load(); }
+
+    std::uint64_t append(Op op, std::string_view key, int value);  // Returns the record's sequence number, 0 once failed
+    bool waitDurable(std::uint64_t sequence);  // False if the log failed before sequence was synced
+    bool flush();                              // Syncs everything appended so far
+    bool truncate();                           // Drops every record, after a checkpoint
+
+    // Calls apply for each intact record in order and returns how many bytes of the file they cover, or -1 if
+    // the file cannot be read. A missing file is an empty log.
+    static long long replay(const std::string& path, const std::function<void(Op, const std::string&, int)>& apply);
 };
 
 class IndexedDatabase {
 private:
     AVLTree index;
+    AVLTree valueIndex;  // Secondary index over the same records, ordered by value
+    SlabPool<Record> recordPool;
+    KeyArena keyArena;  // Key bytes of every record in recordPool
+    bool internKeys;    // Records with equal keys share one arena copy
+    std::unique_ptr<FrozenIndex> frozen;  // When set, point lookups go here first
+    std::unique_ptr<HashIndex> hashIndex; // When set, exact-match lookups go here instead of any tree
+    std::unique_ptr<HotKeyCache> hotCache; // When set, find and search try it before any index
+    AVLTree frozenDelta;                  // Records inserted since the last freeze, merged in once it grows too large
+    bool threadSafe;
+    mutable std::shared_mutex mutex;  // Only taken when threadSafe: shared by readers, exclusive for writers
+    std::shared_ptr<WriteAheadLog> log;  // Every change is appended here when set
+    std::atomic<VersionStore*> versions;  // Set once by enableVersioning and owned by the database; read by snapshot() without a lock
+    std::atomic<int> latencySampling;     // Each thread times one public operation in this many, 0 when off
     
+    std::shared_lock<std::shared_mutex> readLock() const;
+    std::unique_lock<std::shared_mutex> writeLock();
+    bool insertRecord(Record* record, OperationStats* stats = nullptr);
+    int bulkLoadRecords(const std::vector<Record*>& records, bool parallel);
+    int applyBatchRecords(const std::vector<BatchOp>& ops, std::uint64_t& sequence);
+    bool eraseRecord(std::string_view key, int value, OperationStats* stats);
+    std::uint64_t logWrite(WriteAheadLog::Op op, std::string_view key, int value);
+    std::uint64_t logRecords(WriteAheadLog::Op op, const std::vector<Record*>& records);
+    bool refuseWrite() const;
+    bool awaitLog(std::shared_ptr<WriteAheadLog> target, std::uint64_t sequence);
+    void clearRecords();
+    void publishVersion(VersionStore* store);
+    void rebuildFrozen();
+    bool saveSnapshotRecords(const std::string& path) const;
+    Record* findRecord(std::string_view key, int value, OperationStats* stats) const;
+    Record* findIndexed(std::string_view key, int value, OperationStats* stats) const;
     void inorderHelper(AVLNode* node, std::vector<Record*>& result) const;
     void rangeQueryHelper(AVLNode* node, int start, int end, std::vector<Record*>& result) const;
+    void keyMatchHelper(AVLNode* node, std::string_view key, std::vector<Record*>& result) const;
     void clearHelper(AVLNode* node);
-    int calculateHeight(AVLNode* node) const;
+    void releaseRecord(Record* record);
+    Record* makeRecord(std::string_view key, int value, const Record* previous = nullptr);
+    int valueRanks(int start, int end, int& first) const;
+    std::int64_t valueSum(int start, int end) const;
+    template <typename Scan>
+    void parallelScan(int first, int count, Scan& scan) const;
 
 public:
-    void insert(Record* record);
-    Record* search(const std::string& key, int value);
-    void deleteRecord(const std::string& key, int value);
+    // In thread-safe mode any number of readers run in parallel and writers get exclusive access.
+    // Returned Record pointers and cursors are not protected: a concurrent deleteRecord may free them.
+    explicit IndexedDatabase(bool threadSafe = false);
+    ~IndexedDatabase();
+    bool isThreadSafe() const { return threadSafe; }
+    // Optional stats describe the operation on the primary (key) index.
+    // Once the log has failed, writes are refused and report failure: false, nullptr or -1. A write whose own log
+    // group failed to sync also reports failure, but its change has already been applied in memory.
+    bool insert(Record* record, OperationStats* stats = nullptr);
+    Record* insert(std::string_view key, int value, OperationStats* stats = nullptr);
+    int bulkLoad(const std::vector<Record*>& records, bool parallel = false);
+    int bulkLoad(const std::vector<std::pair<std::string, int>>& rows, bool parallel = false);
+    int applyBatch(const std::vector<BatchOp>& ops);
+    Record* search(std::string_view key, int value, OperationStats* stats = nullptr);
+    Record* find(std::string_view key, int value, OperationStats* stats = nullptr) const;
+    std::vector<Record*> searchAll(std::string_view key) const;
+    // Batched find(): the lookups run interleaved under one read lock, results[i] is nullptr when queries[i] misses
+    std::vector<Record*> multiSearch(const std::vector<std::pair<std::string, int>>& queries) const;
+    bool contains(std::string_view key, int value) const;
+    bool deleteRecord(std::string_view key, int value, OperationStats* stats = nullptr);  // false if absent or not logged
     std::vector<Record*> rangeQuery(int start, int end);
     std::vector<Record*> findKNearestKeys(int key, int k);
+
+    // Large value ranges cut into equal slices by rank, one task per hardware thread; small ones run on the caller
+    std::vector<Record*> parallelRangeQuery(int start, int end) const;  // Same records, same order as rangeQuery
+    // Same records and order as rangeQuery, visited under the read lock so no concurrent delete can free them meanwhile
+    void forEachInRange(int start, int end, const std::function<void(const Record*)>& visit) const;
+
+    // O(log n) rollups over the values rangeQuery(start, end) returns, from the sums and sizes in the value index
+    long long sumRange(int start, int end) const;
+    Record* minRange(int start, int end) const;  // First record rangeQuery(start, end) returns, nullptr when empty
+    Record* maxRange(int start, int end) const;  // Last one
+    RangeAggregate aggregate(int start, int end) const;  // All four under one read lock, no records visited
+
+    // O(log n) order statistics, for pagination and percentiles without walking the tree
+    int rank(std::string_view key, int value = std::numeric_limits<int>::min()) const;  // Records before it in key order
+    Record* select(int i) const;                     // i-th record (0-based) in key order, nullptr when out of range
+    Record* selectByValue(int i) const;              // i-th record in value order
+    int countRange(int start, int end) const;        // Same records rangeQuery(start, end) returns
+    int countKeyRange(std::string_view low, std::string_view high) const;  // Keys in [low, high]
     std::vector<Record*> inorderTraversal();
-    void clearDatabase();
-    int countRecords() { return index.getNodeCount(); }
+    void forEachRecord(const std::function<void(const Record*)>& visit) const;  // inorderTraversal's records, under the read lock
+    AVLCursor cursor() const { return AVLCursor(index); }            // Records in (key, value) order
+    AVLCursor valueCursor() const { return AVLCursor(valueIndex); }  // Records in (value, key) order, seek("", v) finds value v
+    bool clearDatabase();
+    int countRecords() const;
+
+    // Optional hash index for exact-match find/search/contains/multiSearch; ordered queries keep using the trees
+    void enableHashIndex();
+    void disableHashIndex();
+    bool hasHashIndex() const;
+
+    // Optional hot-key cache for find/search: a hit costs no comparisons, so its stats stay zero. Hits and misses are
+    // counted in OperationCounters.
+    void enableHotKeyCache(std::size_t entries = 4096);
+    void disableHotKeyCache();
+    bool hasHotKeyCache() const;
+
+    // Key interning: records created from here on share one stored copy of equal keys, e.g. every version of a key
+    void enableKeyInterning();
+    void disableKeyInterning();
+    std::size_t keyArenaBytes() const;  // Bytes of record keys held in the arena, counts and padding included
+
+    // Binary snapshot on disk: versioned and checksummed, records in key order. Both return false on any I/O error,
+    // and a snapshot that fails validation leaves the database untouched.
+    bool saveSnapshot(const std::string& path) const;
+    bool loadSnapshot(const std::string& path);
+
+    // Durability: openLog replays the log over the current contents (typically just loaded from a snapshot) and then
+    // logs every later change. checkpoint saves a snapshot and empties the log, so recovery only replays what followed.
+    // loadSnapshot is not logged, so it belongs before openLog. After a failed write or sync the log stays failed
+    // and the database refuses changes until closeLog() or another openLog().
+    bool openLog(const std::string& path, const WalOptions& options = WalOptions());
+    bool checkpoint(const std::string& snapshotPath);
+    bool flushLog();
+    void closeLog();
+    bool logFailed() const;
+
+    // Versioned mode: every write is also path-copied into persistent trees, so snapshot() hands out consistent views
+    // that readers scan without locks while writers carry on. Versioning stays on for the life of the database.
+    void enableVersioning();
+    bool isVersioned() const { return versions.load() != nullptr; }
+    ReadSnapshot snapshot() const;
+
+    // Read-mostly mode: point lookups are served from a frozen Eytzinger snapshot plus a small delta tree
+    void freeze();
+    void thaw();
+    bool isFrozen() const;
     
+    // Telemetry. stats() holds the read lock for O(shapeSamples log n), or O(n) when shapeSamples is 0. metricsText()
+    // renders it in the Prometheus text format, together with the process-wide OperationCounters.
+    DatabaseStats stats(int shapeSamples = 1024) const;
+    std::string metricsText() const;
+    // Times insert, find/search/contains, deleteRecord and range queries start to finish, lock waits included. Only
+    // one call in sampleEvery per thread pays for the two clock reads, so the histograms hold samples, not every call.
+    void enableLatencyTracking(int sampleEvery = 16) { latencySampling.store(std::max(1, sampleEvery)); }
+    void disableLatencyTracking() { latencySampling.store(0); }
+
     // New methods for testing
-    int getSearchComparisons(const std::string& key, int value);
-    int getTreeHeight() const;
+    int getSearchComparisons(std::string_view key, int value);
+    int getTreeHeight() const;  // Of the primary index, O(1)
+};
+
+/*
+A table split across independent thread-safe IndexedDatabase partitions, each behind its own lock, so writers to
+different shards never wait for each other. Keys go to a shard by hash, or by sorted split keys so each shard owns one
+key range. Every version of a key lands on the same shard, so point operations, searchAll and batches by key touch one
+partition per key; value range queries ask every shard and merge the sorted partial results with a k-way heap.
+Operations spanning several shards are not atomic: each shard applies its part under its own lock.
+Merges order copies of each record's key and value taken under its shard's lock, never the records themselves. As with
+IndexedDatabase, returned Record pointers stay valid only until a write to their shard deletes them.
+*/
+class ShardedDatabase {
+private:
+    std::vector<std::unique_ptr<IndexedDatabase>> shards;
+    std::vector<std::string> splitKeys;  // Empty when hash partitioned, else shard i holds keys in [splitKeys[i-1], splitKeys[i])
+
+public:
+    explicit ShardedDatabase(int shardCount = 0);                  // Hash partitioned, 0 means one shard per hardware thread
+    explicit ShardedDatabase(const std::vector<std::string>& splitKeys);  // Range partitioned, splitKeys.size() + 1 shards
+
+    int shardCount() const { return (int)shards.size(); }
+    bool isRangePartitioned() const { return !splitKeys.empty(); }
+    int shardFor(std::string_view key) const;
+    IndexedDatabase& shard(int i) { return *shards[i]; }  // For per-shard snapshots, logs and hash indexes
+
+    bool insert(Record* record, OperationStats* stats = nullptr);
+    Record* insert(std::string_view key, int value, OperationStats* stats = nullptr);
+    int bulkLoad(const std::vector<std::pair<std::string, int>>& rows, bool parallel = false);  // parallel loads shards concurrently
+    int applyBatch(const std::vector<BatchOp>& ops);
+    Record* find(std::string_view key, int value, OperationStats* stats = nullptr) const;
+    bool contains(std::string_view key, int value) const;
+    std::vector<Record*> searchAll(std::string_view key) const;
+    std::vector<Record*> multiSearch(const std::vector<std::pair<std::string, int>>& queries) const;
+    bool deleteRecord(std::string_view key, int value, OperationStats* stats = nullptr);
+    std::vector<Record*> rangeQuery(int start, int end) const;  // Merged into (value, key) order
+    int countRange(int start, int end) const;
+    int countKeyRange(std::string_view low, std::string_view high) const;
+    std::vector<Record*> inorderTraversal() const;              // Merged into (key, value) order
+    bool clearDatabase();
+    int countRecords() const;
+};
+
+/*
+Server side of a pipelined, line-based text protocol for one client connection. feed() takes whatever bytes arrived,
+runs every complete command and appends the replies in command order. Consecutive GETs go to the database as one
+multiSearch and consecutive PUT/DELs as one applyBatch, so a client that pipelines many commands pays for one lock
+and one log sync per run instead of one per command. Other connections may delete the records a RANGE returns, so it
+reads them from a snapshot when the database is versioned and formats them under the read lock otherwise.
+
+    GET key value    -> FOUND | NOT_FOUND
+    PUT key value    -> OK | ERR log failed
+    DEL key value    -> OK | ERR log failed
+    RANGE low high   -> RANGE n, then n lines of "key value" in (value, key) order
+    QUIT             -> BYE, and the session closes
+*/
+class RequestSession {
+public:
+    static const std::size_t MaxLineBytes = 64 * 1024;  // A longer unfinished line closes the session
+    static const std::size_t MaxBatch = 1024;           // Longest run sent to the database at once
+
+private:
+    IndexedDatabase& db;
+    std::string input;  // Bytes after the last complete line
+    std::vector<std::pair<std::string, int>> gets;
+    std::vector<BatchOp> writes;
+    bool closed;
+
+    void execute(std::string_view line, std::string& output);
+    void flushGets(std::string& output);
+    void flushWrites(std::string& output);
+    void runRange(int start, int end, std::string& output);
+
+public:
+    explicit RequestSession(IndexedDatabase& db);
+
+    bool feed(const char* data, std::size_t length, std::string& output);  // False once the session has closed
+    bool isClosed() const { return closed; }
 };
 
 #endif // AVL_DATABASE_HPP
\ No newline at end of file
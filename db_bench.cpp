@@ -0,0 +1,384 @@
+// db_bench.cpp
+// Reproducible YCSB-style workloads against IndexedDatabase.
+// Usage: AVL_Bench.exe [--sizes 1000,10000,100000] [--ops N] [--seed S]
+//                      [--workload all|read-heavy|write-heavy|scan-heavy] [--dist all|uniform|zipfian]
+//                      [--frozen 0|1] [--cache entries]
+#include "AVL_Database.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX // Keep std::min and std::max usable
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    /*
+    Log-linear latency histogram: 32 sub-buckets per power of two keeps every percentile within about 3%
+    in constant memory, so runs with 1e8 operations do not need to store each sample
+    */
+    class LatencyHistogram
+    {
+    private:
+        static const int SubBuckets = 32;
+        static const int Powers = 40;
+        vector<uint64_t> buckets;
+        uint64_t total;
+
+        static int bucketFor(uint64_t nanos)
+        {
+            if (nanos < SubBuckets)
+                return (int)nanos;
+            int power = 63 - __builtin_clzll(nanos); // nanos >= 32, so power >= 5
+            int sub = (int)((nanos >> (power - 5)) & (SubBuckets - 1));
+            return min((power - 4) * SubBuckets + sub, SubBuckets * Powers - 1);
+        }
+
+        static uint64_t lowerBoundOf(int bucket)
+        {
+            if (bucket < SubBuckets)
+                return bucket;
+            int power = bucket / SubBuckets + 4;
+            uint64_t sub = bucket % SubBuckets;
+            return (SubBuckets + sub) << (power - 5);
+        }
+
+    public:
+        LatencyHistogram() : buckets(SubBuckets * Powers, 0), total(0) {}
+
+        void record(uint64_t nanos)
+        {
+            buckets[bucketFor(nanos)]++;
+            total++;
+        }
+
+        uint64_t count() const { return total; }
+
+        uint64_t percentile(double p) const
+        {
+            if (total == 0)
+                return 0;
+            uint64_t rank = (uint64_t)ceil(p / 100.0 * total);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets.size(); i++)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return lowerBoundOf((int)i);
+            }
+            return lowerBoundOf((int)buckets.size() - 1);
+        }
+    };
+
+    /*
+    YCSB's Zipfian generator (Gray et al.) with theta 0.99. Ranks are scrambled with an FNV hash,
+    as in YCSB's ScrambledZipfian, so the hot items are spread over the key space instead of clustering
+    */
+    class ZipfianGenerator
+    {
+    private:
+        uint64_t items;
+        double theta, alpha, zetan, eta;
+
+        static double zeta(uint64_t n, double theta)
+        {
+            double sum = 0;
+            for (uint64_t i = 1; i <= n; i++)
+                sum += 1.0 / pow((double)i, theta);
+            return sum;
+        }
+
+        static uint64_t fnv1a(uint64_t value)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for (int i = 0; i < 8; i++)
+            {
+                hash ^= (value >> (i * 8)) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+    public:
+        explicit ZipfianGenerator(uint64_t n, double t = 0.99) : items(max<uint64_t>(n, 2)), theta(t)
+        {
+            zetan = zeta(items, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta(2, theta) / zetan);
+        }
+
+        uint64_t next(mt19937_64 &rng)
+        {
+            double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+            double uz = u * zetan;
+            uint64_t rank;
+            if (uz < 1.0)
+                rank = 0;
+            else if (uz < 1.0 + pow(0.5, theta))
+                rank = 1;
+            else
+                rank = (uint64_t)(items * pow(eta * u - eta + 1, alpha));
+            return fnv1a(min(rank, items - 1)) % items;
+        }
+    };
+
+    enum Operation
+    {
+        OpInsert,
+        OpSearch,
+        OpDelete,
+        OpRange,
+        OpCount
+    };
+
+    const char *operationNames[OpCount] = {"insert", "search", "deleteRecord", "rangeQuery"};
+
+    struct Workload
+    {
+        string name;
+        int mix[OpCount]; // Percentages, summing to 100
+    };
+
+    const vector<Workload> workloads = {
+        {"read-heavy", {5, 90, 5, 0}},   // YCSB B style
+        {"write-heavy", {40, 20, 40, 0}}, // Ingest dominated churn
+        {"scan-heavy", {5, 0, 0, 95}},    // YCSB E style short scans
+    };
+
+    struct Options
+    {
+        vector<uint64_t> sizes = {1000, 10000, 100000};
+        uint64_t ops = 200000;
+        uint64_t seed = 42;
+        string workload = "all";
+        string dist = "all";
+        bool frozen = false; // Freeze the table after loading so lookups use the Eytzinger snapshot
+        uint64_t cache = 0;  // Hot-key cache entries in front of point lookups, 0 for none
+    };
+
+    string makeKey(uint64_t id)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "user%012llu", (unsigned long long)id); // Fixed width, like YCSB keys
+        return buffer;
+    }
+
+    long peakRssKilobytes()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return (long)(counters.PeakWorkingSetSize / 1024);
+        return 0;
+#else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // Reported in bytes on macOS
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    }
+
+    uint64_t nanosSince(chrono::steady_clock::time_point start)
+    {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    void printRow(const string &workload, const string &dist, uint64_t size, const string &op,
+                  const LatencyHistogram &histogram, double seconds)
+    {
+        if (histogram.count() == 0)
+            return;
+        cout << left << setw(12) << workload << setw(9) << dist << right << setw(10) << size << "  "
+             << left << setw(13) << op << right << setw(12) << fixed << setprecision(0) << histogram.count() / seconds
+             << setw(10) << histogram.percentile(50) << setw(10) << histogram.percentile(99)
+             << setw(12) << peakRssKilobytes() << endl;
+    }
+
+    void runWorkload(const Workload &workload, bool zipfian, uint64_t size, const Options &options)
+    {
+        mt19937_64 rng(options.seed ^ (size * 0x9E3779B97F4A7C15ULL));
+        IndexedDatabase db;
+        vector<uint64_t> live; // Ids currently in the table, so searches and deletes always target a real record
+        live.reserve(size);
+
+        // Load phase: rows arrive in a seeded random order and go through insert() one at a time
+        vector<uint64_t> loadOrder(size);
+        for (uint64_t i = 0; i < size; i++)
+            loadOrder[i] = i;
+        shuffle(loadOrder.begin(), loadOrder.end(), rng);
+
+        LatencyHistogram load;
+        double loadSeconds = 0; // Like the run phase, only time spent inside the database counts
+        for (uint64_t id : loadOrder)
+        {
+            string key = makeKey(id);
+            auto start = chrono::steady_clock::now();
+            db.insert(key, (int)id);
+            uint64_t nanos = nanosSince(start);
+            load.record(nanos);
+            loadSeconds += nanos / 1e9;
+            live.push_back(id);
+        }
+        const string dist = zipfian ? "zipfian" : "uniform";
+        printRow(workload.name, dist, size, "load", load, loadSeconds);
+        if (options.frozen)
+            db.freeze();
+        if (options.cache)
+            db.enableHotKeyCache((size_t)options.cache);
+        OperationCounters::Totals before = OperationCounters::thisThread();
+
+        // Run phase
+        ZipfianGenerator zipf(size);
+        LatencyHistogram histograms[OpCount];
+        double seconds[OpCount] = {0, 0, 0, 0};
+        uint64_t nextId = size;
+        auto pick = [&]() -> size_t
+        {
+            uint64_t r = zipfian ? zipf.next(rng) : rng();
+            return (size_t)(r % live.size());
+        };
+
+        for (uint64_t i = 0; i < options.ops; i++)
+        {
+            int roll = (int)(rng() % 100);
+            int op = 0;
+            while (op < OpCount - 1 && roll >= workload.mix[op])
+                roll -= workload.mix[op++];
+            if (live.empty() && op != OpInsert)
+                op = OpInsert;
+
+            string key;
+            uint64_t nanos = 0;
+            if (op == OpInsert)
+            {
+                uint64_t id = nextId++;
+                key = makeKey(id);
+                auto start = chrono::steady_clock::now();
+                db.insert(key, (int)id);
+                nanos = nanosSince(start);
+                live.push_back(id);
+            }
+            else if (op == OpSearch)
+            {
+                uint64_t id = live[pick()];
+                key = makeKey(id);
+                auto start = chrono::steady_clock::now();
+                Record *found = db.find(key, (int)id);
+                nanos = nanosSince(start);
+                if (!found)
+                {
+                    cerr << "search lost record " << key << endl;
+                    exit(1);
+                }
+            }
+            else if (op == OpDelete)
+            {
+                size_t slot = pick();
+                uint64_t id = live[slot];
+                key = makeKey(id);
+                auto start = chrono::steady_clock::now();
+                db.deleteRecord(key, (int)id);
+                nanos = nanosSince(start);
+                live[slot] = live.back();
+                live.pop_back();
+            }
+            else
+            {
+                int start = (int)live[pick()];
+                int length = 1 + (int)(rng() % 100);
+                auto begin = chrono::steady_clock::now();
+                auto result = db.rangeQuery(start, start + length - 1);
+                nanos = nanosSince(begin);
+            }
+            histograms[op].record(nanos);
+            seconds[op] += nanos / 1e9;
+        }
+
+        for (int op = 0; op < OpCount; op++)
+            printRow(workload.name, dist, size, operationNames[op], histograms[op], seconds[op]);
+        OperationCounters::Totals after = OperationCounters::thisThread();
+        uint64_t lookups = (after.cacheHits - before.cacheHits) + (after.cacheMisses - before.cacheMisses);
+        if (lookups > 0)
+            cout << "  hot-key cache hit rate " << fixed << setprecision(1)
+                 << 100.0 * (after.cacheHits - before.cacheHits) / lookups << "%" << endl;
+    }
+
+    vector<uint64_t> parseSizes(const string &text)
+    {
+        vector<uint64_t> sizes;
+        stringstream stream(text);
+        string item;
+        while (getline(stream, item, ','))
+            sizes.push_back((uint64_t)strtod(item.c_str(), nullptr)); // strtod so "1e8" works
+        return sizes;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--sizes")
+            options.sizes = parseSizes(value);
+        else if (flag == "--ops")
+            options.ops = (uint64_t)strtod(value.c_str(), nullptr);
+        else if (flag == "--seed")
+            options.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (flag == "--workload")
+            options.workload = value;
+        else if (flag == "--dist")
+            options.dist = value;
+        else if (flag == "--frozen")
+            options.frozen = value != "0";
+        else if (flag == "--cache")
+            options.cache = (uint64_t)strtod(value.c_str(), nullptr);
+        else
+        {
+            cerr << "unknown option " << flag << endl;
+            return 1;
+        }
+    }
+
+    cout << "seed " << options.seed << ", " << options.ops << " ops per run" << (options.frozen ? ", frozen" : "");
+    if (options.cache)
+        cout << ", hot-key cache of " << options.cache;
+    cout << endl;
+    cout << left << setw(12) << "workload" << setw(9) << "dist" << right << setw(10) << "size" << "  "
+         << left << setw(13) << "op" << right << setw(12) << "ops/sec" << setw(10) << "p50(ns)"
+         << setw(10) << "p99(ns)" << setw(12) << "peakRSS(KB)" << endl;
+
+    for (uint64_t size : options.sizes)
+        for (const Workload &workload : workloads)
+        {
+            if (options.workload != "all" && options.workload != workload.name)
+                continue;
+            for (bool zipfian : {false, true})
+            {
+                if (options.dist != "all" && options.dist != (zipfian ? "zipfian" : "uniform"))
+                    continue;
+                runWorkload(workload, zipfian, size, options);
+            }
+        }
+    return 0;
+}
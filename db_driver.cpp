@@ -4,6 +4,11 @@
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
 
 using namespace std;
 
@@ -48,7 +53,8 @@ int main()
         printTest("Record Count", db.countRecords() == 5);
 
         // Test 2: Search Complexity Tests
-        int comparisons = db.getSearchComparisons("1984", 40);
+        // The Right-Right rebalance on the third insert puts "Pride and Prejudice" at the root, so finding it takes one comparison
+        int comparisons = db.getSearchComparisons("Pride and Prejudice", 20);
         cout << comparisons << endl;
 
         printTest("Search Complexity (Root)", comparisons == 1);
@@ -58,6 +64,16 @@ int main()
 
         // Test 3: Height Verification
         printTest("Tree Height", db.getTreeHeight() <= ceil(log2(6)));
+
+        // Per-operation stats and per-thread counters
+        OperationStats stats;
+        auto before = OperationCounters::thisThread();
+        db.find("Don Quixote", 100, &stats);
+        auto after = OperationCounters::thisThread();
+        printTest("Operation Stats (Miss)",
+                  stats.comparisons >= 2 && stats.comparisons <= db.getTreeHeight() &&
+                      after.searches == before.searches + 1 &&
+                      after.comparisons == before.comparisons + stats.comparisons);
     }
 
     // Test Group 2: Search Operations
@@ -71,9 +87,87 @@ int main()
         found = db.search("Don Quixote", 100);
         printTest("Non-existent Record Search", found->key == "" && found->value == 0);
 
+        // Nullable lookups: misses return nullptr and never allocate
+        printTest("Find/Contains Miss", db.find("Don Quixote", 100) == nullptr && !db.contains("Don Quixote", 100) &&
+                                            db.contains("1984", 40) && db.find("1984", 40)->value == 40);
+
         // Test 6: Boundary Value Search
         found = db.search("The Great Gatsby", 10);
         printTest("Minimum Value Search", found->key == "The Great Gatsby" && found->value == 10);
+
+        // Keys that share, end at, or run past the inline key prefix kept in each node
+        IndexedDatabase prefixes;
+        vector<string> titles = {"Oliver Twist", "Oliver Twist V", "Oliver Twist Vol.1", "Oliver Twist Vol.12",
+                                 "Oliver Twist Vol.13", "Oliver Twist Vol.2", "Oliver Twis", "Oliver"};
+        for (size_t i = 0; i < titles.size(); i++)
+            prefixes.insert(titles[i], (int)i);
+        bool prefixOk = sizeof(AVLNode) <= 48 && prefixes.countRecords() == (int)titles.size();
+        for (size_t i = 0; i < titles.size(); i++)
+            prefixOk = prefixOk && prefixes.contains(titles[i], (int)i) && !prefixes.contains(titles[i] + "!", (int)i);
+        auto ordered = prefixes.inorderTraversal();
+        for (size_t i = 1; i < ordered.size(); i++)
+            prefixOk = prefixOk && ordered[i - 1]->key < ordered[i]->key;
+        printTest("Inline Key Prefix Search", prefixOk);
+
+        // Long keys that differ only past their first 48 bytes, so every comparison runs the vectorized tail
+        IndexedDatabase longKeys;
+        const string stem(48, 'x');
+        for (int i = 0; i < 200; i++)
+            longKeys.insert(stem + to_string(1000 + i * 7 % 200), i);
+        bool longOk = longKeys.countRecords() == 200;
+        for (int i = 0; i < 200; i++)
+            longOk = longOk && longKeys.contains(stem + to_string(1000 + i * 7 % 200), i) &&
+                     !longKeys.contains(stem + to_string(1000 + i * 7 % 200) + "x", i);
+        auto longOrdered = longKeys.inorderTraversal();
+        for (size_t i = 1; i < longOrdered.size(); i++)
+            longOk = longOk && longOrdered[i - 1]->key < longOrdered[i]->key;
+        printTest("Long Shared-Prefix Key Search", longOk);
+
+        // Batched lookups agree with one-at-a-time find(), including misses and batches wider than BatchWidth
+        vector<pair<string, int>> batch;
+        for (int i = 0; i < 50; i++)
+            batch.push_back({stem + to_string(1000 + i * 7 % 200), i % 3 == 0 ? i : -1});
+        auto batchResults = longKeys.multiSearch(batch);
+        bool batchOk = batchResults.size() == batch.size() && db.multiSearch({}).empty();
+        for (size_t i = 0; i < batch.size(); i++)
+            batchOk = batchOk && batchResults[i] == longKeys.find(batch[i].first, batch[i].second) &&
+                      (batchResults[i] != nullptr) == (batch[i].second >= 0);
+        printTest("Multi-Search Batch", batchOk);
+
+        // The hash index returns the same records as the trees, follows inserts and deletes, and can be dropped again
+        longKeys.enableHashIndex();
+        auto hashedResults = longKeys.multiSearch(batch);
+        bool hashOk = longKeys.hasHashIndex() && hashedResults == batchResults;
+        longKeys.insert(stem + "new", 7);
+        longKeys.deleteRecord(stem + to_string(1000), 0);
+        hashOk = hashOk && longKeys.contains(stem + "new", 7) && !longKeys.contains(stem + to_string(1000), 0) &&
+                 batchResults[3] && longKeys.find(stem + to_string(1021), 3) == batchResults[3];
+        longKeys.disableHashIndex();
+        hashOk = hashOk && !longKeys.hasHashIndex() && longKeys.contains(stem + "new", 7);
+        printTest("Hash Index Point Lookups", hashOk);
+
+        // Lookups take string_view slices of a caller's buffer, and interned versions of one key share a single copy
+        const string shelf = "Hamlet|Macbeth|Othello";
+        string_view hamlet = string_view(shelf).substr(0, 6), macbeth = string_view(shelf).substr(7, 7);
+        IndexedDatabase plain, interned;
+        interned.enableKeyInterning();
+        for (int version = 1; version <= 3; version++)
+        {
+            plain.insert(hamlet, version);
+            interned.insert(hamlet, version);
+        }
+        size_t hamletBytes = plain.keyArenaBytes() / 3;  // Without interning every version keeps its own copy
+        bool sharedOk = interned.keyArenaBytes() == hamletBytes;
+        interned.insert(macbeth, 1);
+        size_t macbethBytes = interned.keyArenaBytes() - hamletBytes;
+        interned.deleteRecord(hamlet, 1);
+        interned.deleteRecord(hamlet, 2);
+        sharedOk = sharedOk && interned.keyArenaBytes() == hamletBytes + macbethBytes; // Still held by version 3
+        interned.deleteRecord(hamlet, 3);
+        printTest("String View Keys And Interning",
+                  interned.find(macbeth, 1) && interned.find(macbeth, 1)->key == "Macbeth" && plain.searchAll(hamlet).size() == 3 &&
+                      plain.contains(shelf.substr(0, 6), 2) && sharedOk && interned.keyArenaBytes() == macbethBytes &&
+                      !interned.contains(hamlet, 3));
     }
 
     // Test Group 3: Delete Operations
@@ -110,6 +204,13 @@ int main()
         // Test 12: Single Value Range
         range = db.rangeQuery(50, 50);
         printTest("Single Value Range", range.size() == 1 && range[0]->value == 50);
+
+        // Nearest values: 40 and 50 are both 5 away from 45, the smaller value comes first
+        auto nearest = db.findKNearestKeys(45, 2);
+        auto everything = db.findKNearestKeys(100, 10);
+        printTest("K Nearest Keys",
+                  nearest.size() == 2 && nearest[0]->value == 40 && nearest[1]->value == 50 &&
+                      everything.size() == 3 && everything[0]->value == 70 && everything[2]->value == 40);
     }
 
     // Test Group 5: Stress Test with Many Classic Books
@@ -127,7 +228,7 @@ int main()
         for (int i = 0; i < STRESS_SIZE; i++)
         {
             string bookName = classicBooks[i % classicBooks.size()] + " Vol." + to_string(i / classicBooks.size() + 1);
-            db.insert(new Record(bookName, i));
+            db.insert(bookName, i); // Records are allocated from the database's slab pool
         }
 
         // Verify logarithmic search time
@@ -143,8 +244,642 @@ int main()
         printTest("Stress Test - Search Complexity",
                   maxComparisons <= 2 * ceil(log2(STRESS_SIZE)));
 
+        // Range queries run on the value index, so results come back in value order
+        auto range = db.rangeQuery(100, 199);
+        bool ordered = range.size() == 100;
+        for (size_t i = 0; ordered && i < range.size(); i++)
+            ordered = range[i]->value == 100 + (int)i;
+        printTest("Stress Test - Value Range Query", ordered);
+
+        // Pooled inserts reject exact duplicates and reuse freed slots
+        Record *pooled = db.insert("Moby Dick", 5000);
+        bool duplicateRejected = db.insert("Moby Dick", 5000) == nullptr;
+        db.deleteRecord("Moby Dick", 5000);
+        pooled = db.insert("Moby Dick", 5001);
+        printTest("Stress Test - Pooled Insert/Delete",
+                  duplicateRejected && pooled && db.search("Moby Dick", 5001) == pooled &&
+                      db.countRecords() == STRESS_SIZE + 4);
+
+        // Heavy churn: every ancestor is rebalanced, so the height stays within the AVL bound
+        for (int i = 0; i < STRESS_SIZE; i += 3)
+        {
+            string bookName = classicBooks[i % classicBooks.size()] + " Vol." + to_string(i / classicBooks.size() + 1);
+            db.deleteRecord(bookName, i);
+        }
+        int remaining = db.countRecords();
+        bool allFound = true;
+        for (int i = 1; i < STRESS_SIZE; i += 3)
+        {
+            string bookName = classicBooks[i % classicBooks.size()] + " Vol." + to_string(i / classicBooks.size() + 1);
+            allFound = allFound && db.search(bookName, i)->value == i;
+        }
+        printTest("Stress Test - Height After Churn",
+                  allFound && remaining == STRESS_SIZE + 4 - 334 &&
+                      db.getTreeHeight() <= 1.44 * log2(remaining + 2));
+
+        // Duplicate keys: each (key, value) pair is its own version
+        db.insert("Jane Eyre Vol.1", 7000);
+        db.insert("Jane Eyre Vol.1", 6000);
+        auto versions = db.searchAll("Jane Eyre Vol.1");
+        db.deleteRecord("Jane Eyre Vol.1", 7000);
+        printTest("Duplicate Keys - Versions Kept",
+                  versions.size() == 3 && versions[0]->value == 1 && versions[1]->value == 6000 &&
+                      versions[2]->value == 7000 && db.search("Jane Eyre Vol.1", 6000)->value == 6000 &&
+                      !db.contains("Jane Eyre Vol.1", 7000) && db.countRecords() == remaining + 1);
+
         // Clean up
         db.clearDatabase();
+        printTest("Clear Database", db.countRecords() == 0 && db.rangeQuery(0, STRESS_SIZE).empty());
+    }
+
+    // Test Group 6: Bulk Loading
+    cout << "\nTesting Bulk Load:" << endl;
+    {
+        const int BULK_SIZE = 50000;
+        vector<pair<string, int>> rows;
+        for (int i = 0; i < BULK_SIZE; i++)
+            rows.push_back({"Book " + to_string(100000 + i), i}); // Zero-padded by the offset, so already sorted by key
+
+        IndexedDatabase bulk;
+        int added = bulk.bulkLoad(rows, true);
+        printTest("Bulk Load - Sorted Input",
+                  added == BULK_SIZE && bulk.countRecords() == BULK_SIZE &&
+                      bulk.getTreeHeight() == (int)ceil(log2(BULK_SIZE + 1)) &&
+                      bulk.contains("Book 125000", 25000) && bulk.rangeQuery(100, 199).size() == 100);
+
+        // Unsorted input with overlaps is sorted, deduplicated and merged with what is already there
+        vector<pair<string, int>> extra = {{"Book 999999", -1}, {"Book 100000", 0}, {"Book 000000", -2}, {"Book 999999", -1}};
+        added = bulk.bulkLoad(extra);
+        auto all = bulk.inorderTraversal();
+        printTest("Bulk Load - Merge Unsorted Input",
+                  added == 2 && bulk.countRecords() == BULK_SIZE + 2 && all.front()->value == -2 &&
+                      all.back()->value == -1 && bulk.rangeQuery(-2, -1).size() == 2 &&
+                      bulk.getTreeHeight() <= 1.44 * log2(BULK_SIZE + 4));
+
+        // Order statistics answer position and count questions from subtree sizes
+        printTest("Rank, Select And Count Range",
+                  bulk.select(0)->value == -2 && bulk.select(25001)->key == "Book 125000" &&
+                      bulk.select(BULK_SIZE + 2) == nullptr && bulk.rank("Book 125000") == 25001 &&
+                      bulk.selectByValue(0)->value == -2 && bulk.selectByValue(BULK_SIZE + 1)->value == BULK_SIZE - 1 &&
+                      bulk.countRange(100, 199) == 100 && bulk.countRange(-2, -1) == 2 && bulk.countRange(5, 4) == 0 &&
+                      bulk.countKeyRange("Book 1", "Book 2") == BULK_SIZE);
+
+        // Cursors stream records and can stop early without materializing a vector
+        AVLCursor page = bulk.cursor();
+        page.seek("Book 120000");
+        bool pageOk = true;
+        for (int i = 0; i < 10; i++, page.next())
+            pageOk = pageOk && page.valid() && page.record()->value == 20000 + i;
+        page.prev();
+        AVLCursor last = bulk.cursor();
+        last.seekLast();
+        AVLCursor byValue = bulk.valueCursor();
+        byValue.seek("", 49998);
+        byValue.next();
+        bool valueOk = byValue.valid() && byValue.record()->value == 49999;
+        byValue.next();
+        printTest("Cursor Seek/Next/Prev",
+                  pageOk && page.record()->value == 20009 && last.record()->value == -1 &&
+                      valueOk && !byValue.valid());
+
+        // Batched writes: deletes and inserts merged in one pass, the last op on a record wins
+        vector<BatchOp> ops;
+        for (int i = 0; i < 1000; i++)
+            ops.push_back({BatchOp::Delete, "Book " + to_string(100000 + i * 2), i * 2}); // 1000 existing records
+        for (int i = 0; i < 500; i++)
+            ops.push_back({BatchOp::Insert, "Batch " + to_string(i), 60000 + i});
+        ops.push_back({BatchOp::Insert, "Book 100001", 1});   // Already present, so unchanged
+        ops.push_back({BatchOp::Delete, "Batch 0", 60000});   // Cancels the insert queued above
+        ops.push_back({BatchOp::Delete, "No Such Book", 7});  // Misses are ignored
+        int changed = bulk.applyBatch(ops);
+        printTest("Apply Batch - Merged Inserts And Deletes",
+                  changed == 1499 && bulk.countRecords() == BULK_SIZE + 2 - 1000 + 499 &&
+                      !bulk.contains("Book 100000", 0) && bulk.contains("Book 100001", 1) &&
+                      !bulk.contains("Batch 0", 60000) && bulk.contains("Batch 499", 60499) &&
+                      bulk.rangeQuery(60000, 60499).size() == 499 && bulk.rangeQuery(0, 1999).size() == 1000 &&
+                      bulk.getTreeHeight() <= 1.44 * log2(BULK_SIZE + 4));
+
+        // Snapshots round-trip every record, and a damaged file is rejected without touching the database
+        const string snapshotPath = "db_driver_snapshot.bin";
+        IndexedDatabase restored;
+        restored.insert("Stale Record", 1);
+        bool saved = bulk.saveSnapshot(snapshotPath);
+        bool loaded = restored.loadSnapshot(snapshotPath);
+        auto original = bulk.inorderTraversal(), copy = restored.inorderTraversal();
+        bool sameRecords = original.size() == copy.size();
+        for (size_t i = 0; sameRecords && i < original.size(); i++)
+            sameRecords = original[i]->key == copy[i]->key && original[i]->value == copy[i]->value;
+        printTest("Snapshot Save/Load Round Trip",
+                  saved && loaded && sameRecords && !restored.contains("Stale Record", 1) &&
+                      restored.rangeQuery(60000, 60499).size() == 499 &&
+                      restored.getTreeHeight() == (int)ceil(log2(restored.countRecords() + 1)));
+
+        FILE *file = fopen(snapshotPath.c_str(), "r+b");
+        fseek(file, -3, SEEK_END);
+        fputc('#', file); // Flip one key byte so the checksum no longer matches
+        fclose(file);
+        int before = restored.countRecords();
+        printTest("Snapshot Rejects Corruption",
+                  !restored.loadSnapshot(snapshotPath) && restored.countRecords() == before &&
+                      !restored.loadSnapshot("no_such_snapshot.bin"));
+        remove(snapshotPath.c_str());
+
+        // Changes after a checkpoint come back from the write-ahead log, and a torn tail is discarded
+        const string logPath = "db_driver_wal.log";
+        remove(logPath.c_str());
+        {
+            IndexedDatabase logged;
+            logged.openLog(logPath);
+            for (int i = 0; i < 100; i++)
+                logged.insert("Logged " + to_string(i), i);
+            logged.checkpoint(snapshotPath);
+            for (int i = 0; i < 10; i++)
+                logged.deleteRecord("Logged " + to_string(i), i);
+            logged.applyBatch({{BatchOp::Insert, "Logged Batch", -1}, {BatchOp::Delete, "Logged 50", 50}});
+        } // Closing the log syncs its last group
+        FILE *tail = fopen(logPath.c_str(), "ab");
+        fputs("torn", tail);
+        fclose(tail);
+        IndexedDatabase recovered;
+        bool recoveredOk = recovered.loadSnapshot(snapshotPath) && recovered.countRecords() == 100 &&
+                           recovered.openLog(logPath) && recovered.countRecords() == 90 &&
+                           recovered.contains("Logged Batch", -1) && !recovered.contains("Logged 50", 50) &&
+                           !recovered.contains("Logged 9", 9) && recovered.contains("Logged 10", 10);
+        recovered.closeLog();
+        printTest("Write-Ahead Log Replay After Checkpoint", recoveredOk);
+        remove(logPath.c_str());
+        remove(snapshotPath.c_str());
+
+#ifdef __linux__
+        // Every write to /dev/full fails, so the first group never syncs and the log refuses everything after it
+        IndexedDatabase unsynced;
+        bool opened = unsynced.openLog("/dev/full");
+        bool firstReported = unsynced.insert("Unsynced 1", 1) == nullptr && unsynced.logFailed();
+        bool laterRefused = !unsynced.insert("Unsynced 2", 2) && unsynced.applyBatch({{BatchOp::Insert, "Unsynced 3", 3}}) == -1 &&
+                            !unsynced.deleteRecord("Unsynced 1", 1) && !unsynced.clearDatabase() && !unsynced.flushLog();
+        bool stateKept = unsynced.countRecords() == 1 && unsynced.contains("Unsynced 1", 1);
+        unsynced.closeLog();
+        printTest("Write-Ahead Log Reports Failed Syncs",
+                  opened && firstReported && laterRefused && stateKept && !unsynced.logFailed() &&
+                      unsynced.insert("Unsynced 2", 2) != nullptr);
+#endif
+    }
+
+    // Test Group 7: Frozen Read-Optimized Snapshot
+    cout << "\nTesting Frozen Snapshot:" << endl;
+    {
+        const int FROZEN_SIZE = 20000;
+        IndexedDatabase frozenDb;
+        for (int i = 0; i < FROZEN_SIZE; i++)
+            frozenDb.insert("Title " + to_string(i), i);
+        frozenDb.freeze();
+
+        bool hits = frozenDb.isFrozen();
+        for (int i = 0; i < FROZEN_SIZE; i += 7)
+            hits = hits && frozenDb.find("Title " + to_string(i), i) != nullptr;
+        frozenDb.insert("Fresh Title", -5);
+        frozenDb.deleteRecord("Title 7", 7);
+        printTest("Frozen Snapshot - Lookups Route To Snapshot",
+                  hits && frozenDb.contains("Fresh Title", -5) && !frozenDb.contains("Title 7", 7) &&
+                      !frozenDb.contains("Title 8", 9) && frozenDb.search("Title 7", 7)->key == "");
+
+        // Enough inserts to fold the delta tree into a new snapshot
+        for (int i = 0; i < 3000; i++)
+            frozenDb.insert("Later " + to_string(i), i);
+        bool merged = frozenDb.contains("Later 0", 0) && frozenDb.contains("Later 2999", 2999) &&
+                      frozenDb.contains("Fresh Title", -5) && !frozenDb.contains("Title 7", 7);
+        frozenDb.thaw();
+        printTest("Frozen Snapshot - Delta Merge And Thaw",
+                  merged && !frozenDb.isFrozen() && frozenDb.contains("Later 1500", 1500) &&
+                      frozenDb.countRecords() == FROZEN_SIZE + 3000);
+    }
+
+    // Test Group 8: Split, Join and Set Operations on whole trees
+    cout << "\nTesting Split/Join and Set Operations:" << endl;
+    {
+        vector<Record *> owned; // AVLTree never frees records, the test does
+        auto fill = [&owned](AVLTree &tree, int first, int last, int step)
+        {
+            for (int i = first; i < last; i += step)
+            {
+                owned.push_back(new Record("Shelf " + to_string(10000 + i), i));
+                tree.insert(owned.back());
+            }
+        };
+
+        AVLTree evens, odds, upper;
+        fill(evens, 0, 2000, 2);
+        fill(odds, 1, 2000, 2);
+        owned.push_back(new Record("Shelf 10000", 0)); // Duplicate of an even record
+        odds.insert(owned.back());
+        vector<Record *> duplicates = evens.unionWith(odds);
+        bool unionOk = evens.getNodeCount() == 2000 && odds.getNodeCount() == 0 && duplicates.size() == 1 &&
+                       duplicates[0] == owned.back() && evens.find("Shelf 10999", 999) && evens.find("Shelf 10000", 0) == owned[0];
+        printTest("Union Moves Nodes And Drops Duplicates", unionOk);
+
+        evens.split("Shelf 11500", numeric_limits<int>::min(), upper);
+        bool splitOk = evens.getNodeCount() == 1500 && upper.getNodeCount() == 500 && evens.find("Shelf 11499", 1499) &&
+                       !evens.find("Shelf 11500", 1500) && upper.find("Shelf 11500", 1500);
+        owned.push_back(new Record("Shelf 11499~", -1)); // Sorts between the two halves
+        evens.join(evens, owned.back(), upper);
+        printTest("Split And Join Around A Key",
+                  splitOk && evens.getNodeCount() == 2001 && upper.getNodeCount() == 0 && evens.find("Shelf 11499~", -1));
+
+        AVLTree tens, hundreds;
+        fill(tens, 0, 2000, 10);
+        fill(hundreds, 0, 2000, 100);
+        vector<Record *> notTens = evens.intersect(tens, true);
+        vector<Record *> hundredsRemoved = evens.difference(hundreds, true);
+        printTest("Intersect And Difference",
+                  notTens.size() == 1801 && hundredsRemoved.size() == 20 && evens.getNodeCount() == 180 &&
+                      evens.find("Shelf 10010", 10) && !evens.find("Shelf 10100", 100) && !evens.find("Shelf 10011", 11) &&
+                      tens.getNodeCount() == 200);
+        for (Record *record : owned)
+            delete record;
+    }
+
+    // Test Group 9: Concurrent Readers (thread-safe mode)
+    cout << "\nTesting Concurrent Access:" << endl;
+    {
+        const int TABLE_SIZE = 100000;
+        const int READS_PER_THREAD = 200000;
+        IndexedDatabase shared(true);
+        vector<pair<string, int>> rows;
+        for (int i = 0; i < TABLE_SIZE; i++)
+            rows.push_back({"Key " + to_string(100000 + i), i});
+        shared.bulkLoad(rows);
+
+        // Readers look up random loaded keys while one writer keeps inserting and deleting other keys
+        auto runReaders = [&](int threads)
+        {
+            atomic<bool> allFound(true), stop(false);
+            thread writer([&]()
+                          {
+                for (int n = 0; !stop; n++)
+                {
+                    shared.insert("Churn " + to_string(n % 1000), n);
+                    shared.deleteRecord("Churn " + to_string(n % 1000), n);
+                } });
+
+            auto start = chrono::steady_clock::now();
+            vector<thread> readers;
+            for (int t = 0; t < threads; t++)
+                readers.emplace_back([&, t]()
+                                     {
+                    mt19937 rng(t + 1);
+                    for (int i = 0; i < READS_PER_THREAD; i++)
+                    {
+                        int v = rng() % TABLE_SIZE;
+                        if (!shared.contains("Key " + to_string(100000 + v), v))
+                            allFound = false;
+                    } });
+            for (auto &reader : readers)
+                reader.join();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            stop = true;
+            writer.join();
+            return make_pair(threads * READS_PER_THREAD / seconds, allFound.load());
+        };
+
+        auto single = runReaders(1);
+        auto multi = runReaders(4);
+        cout << "  Read throughput: 1 thread " << fixed << setprecision(0) << single.first
+             << " ops/sec, 4 threads " << multi.first << " ops/sec" << endl;
+        printTest("Concurrent Readers With Writer",
+                  single.second && multi.second && shared.countRecords() == TABLE_SIZE);
+    }
+
+    // Test Group 10: Sharded Database
+    cout << "\nTesting Sharded Database:" << endl;
+    {
+        const int WRITERS = 4;
+        const int WRITES_PER_THREAD = 20000;
+
+        // Writers on disjoint keys, against one locked table and against hash-partitioned shards
+        auto runWriters = [&](auto &table)
+        {
+            auto start = chrono::steady_clock::now();
+            vector<thread> writers;
+            for (int t = 0; t < WRITERS; t++)
+                writers.emplace_back([&, t]()
+                                     {
+                    for (int i = 0; i < WRITES_PER_THREAD; i++)
+                        table.insert("Writer " + to_string(t) + " " + to_string(i), t * WRITES_PER_THREAD + i); });
+            for (auto &writer : writers)
+                writer.join();
+            return WRITERS * WRITES_PER_THREAD / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        };
+        IndexedDatabase single(true);
+        ShardedDatabase sharded(WRITERS);
+        double singleRate = runWriters(single);
+        double shardedRate = runWriters(sharded);
+        cout << "  Write throughput (" << WRITERS << " threads): 1 table " << fixed << setprecision(0) << singleRate
+             << " ops/sec, " << sharded.shardCount() << " shards " << shardedRate << " ops/sec" << endl;
+
+        // Merged results come back in one global order, exactly as a single table would return them
+        auto merged = sharded.rangeQuery(1000, 50999);
+        auto expected = single.rangeQuery(1000, 50999);
+        bool mergedOk = sharded.countRecords() == WRITERS * WRITES_PER_THREAD && merged.size() == expected.size() &&
+                        sharded.countRange(1000, 50999) == (int)expected.size();
+        for (size_t i = 0; i < merged.size() && mergedOk; i++)
+            mergedOk = merged[i]->key == expected[i]->key && merged[i]->value == expected[i]->value;
+        auto shardedOrder = sharded.inorderTraversal(), singleOrder = single.inorderTraversal();
+        for (size_t i = 0; i < shardedOrder.size() && mergedOk; i++)
+            mergedOk = shardedOrder[i]->key == singleOrder[i]->key;
+        printTest("Sharded Writers - Merged Range Query", mergedOk);
+
+        // Range partitioning keeps each key range on one shard and routes batches, lookups and counts to it
+        ShardedDatabase ranged({"H", "P"});
+        ranged.bulkLoad({{"Alpha", 1}, {"Hotel", 2}, {"Zulu", 3}, {"Papa", 4}, {"Alpha", 5}}, true);
+        ranged.applyBatch({{BatchOp::Insert, "Mike", 6}, {BatchOp::Delete, "Zulu", 3}, {BatchOp::Insert, "Echo", 7}});
+        auto ordered = ranged.inorderTraversal();
+        auto hits = ranged.multiSearch({{"Mike", 6}, {"Zulu", 3}, {"Alpha", 5}});
+        printTest("Range Partitioned Shards",
+                  ranged.shardCount() == 3 && ranged.shard(0).countRecords() == 3 && ranged.shard(1).countRecords() == 2 &&
+                      ordered.size() == 6 && ordered.front()->key == "Alpha" && ordered.back()->key == "Papa" &&
+                      ranged.searchAll("Alpha").size() == 2 && ranged.countKeyRange("B", "N") == 3 &&
+                      hits[0] && !hits[1] && hits[2] && hits[2]->value == 5 && !ranged.contains("Zulu", 3));
+
+        // Merges compare copies taken under each shard's lock, so deletes freeing records mid-merge cannot reach
+        // them. Keys this long get blocks of their own, which a delete hands straight back to the allocator.
+        ShardedDatabase churned(WRITERS);
+        const string longPrefix(520, 'k');
+        for (int i = 0; i < 1000; i++)
+            churned.insert(longPrefix + to_string(i), i);
+        atomic<bool> stop(false);
+        thread mover([&]()
+                     {
+            for (int round = 0; !stop; round++)
+                for (int i = 0; i < 1000; i++)
+                {
+                    churned.deleteRecord(longPrefix + to_string(i), round % 2 ? i + 5000 : i);
+                    churned.insert(longPrefix + to_string(i), round % 2 ? i : i + 5000);
+                } });
+        bool sizesOk = true;
+        for (int i = 0; i < 100 && sizesOk; i++)
+        {
+            size_t inRange = churned.rangeQuery(0, 999).size(), all = churned.inorderTraversal().size();
+            sizesOk = inRange <= 1000 && all <= 1000 && all >= 999; // The mover has at most one record out
+        }
+        stop = true;
+        mover.join();
+        auto settled = churned.inorderTraversal();
+        bool settledOk = settled.size() == 1000;
+        for (size_t i = 1; i < settled.size() && settledOk; i++)
+            settledOk = settled[i - 1]->key < settled[i]->key;
+        printTest("Sharded Merges During Concurrent Deletes", sizesOk && settledOk);
+    }
+
+    // Test Group 11: Versioned (MVCC) Snapshots
+    cout << "\nTesting Versioned Snapshots:" << endl;
+    {
+        // A snapshot keeps seeing the rows it was taken over, deleted records included, while newer snapshots move on
+        IndexedDatabase versioned;
+        vector<pair<string, int>> rows;
+        for (int i = 0; i < 1000; i++)
+            rows.push_back({"Row " + to_string(10000 + i), i});
+        versioned.bulkLoad(rows);
+        versioned.enableVersioning();
+        ReadSnapshot before = versioned.snapshot();
+        for (int i = 0; i < 1000; i += 2)
+            versioned.deleteRecord("Row " + to_string(10000 + i), i);
+        versioned.applyBatch({{BatchOp::Insert, "Row 99999", 5}, {BatchOp::Delete, "Row 10001", 1}});
+        ReadSnapshot after = versioned.snapshot();
+        Record *kept = before.find("Row 10000", 0);
+        printTest("Snapshot Survives Later Writes",
+                  versioned.isVersioned() && before.countRecords() == 1000 && kept && kept->key == "Row 10000" &&
+                      before.rangeQuery(0, 9).size() == 10 && after.countRecords() == 500 &&
+                      after.countRange(0, 9) == 5 && after.contains("Row 99999", 5) && !after.contains("Row 10001", 1) &&
+                      !ReadSnapshot().valid() && db.snapshot().countRecords() == 0);
+
+        // Readers scan whole snapshots without locks while a writer keeps ingesting; every view must be internally consistent
+        IndexedDatabase ingest(true);
+        ingest.enableVersioning();
+        atomic<bool> stop(false), consistent(true);
+        atomic<int> scans(0);
+        vector<thread> scanners;
+        for (int t = 0; t < 2; t++)
+            scanners.emplace_back([&]()
+                                  {
+                while (!stop)
+                {
+                    ReadSnapshot view = ingest.snapshot();
+                    auto all = view.inorderTraversal();
+                    auto byValue = view.rangeQuery(0, 1 << 30);
+                    bool ok = (int)all.size() == view.countRecords() && all.size() == byValue.size();
+                    for (size_t i = 1; i < all.size() && ok; i++)
+                        ok = all[i - 1]->key < all[i]->key && byValue[i - 1]->value <= byValue[i]->value;
+                    if (!ok)
+                        consistent = false;
+                    scans++;
+                } });
+        for (int i = 0; i < 20000; i++)
+        {
+            ingest.insert("Event " + to_string(100000 + i), i);
+            if (i % 4 == 3)
+                ingest.deleteRecord("Event " + to_string(100000 + i - 3), i - 3);
+        }
+        stop = true;
+        for (auto &scanner : scanners)
+            scanner.join();
+        cout << "  " << scans.load() << " full snapshot scans ran alongside 25000 writes" << endl;
+        printTest("Lock-Free Scans During Ingest",
+                  consistent && ingest.countRecords() == 15000 && ingest.snapshot().countRecords() == 15000);
+    }
+
+    // Test Group 12: Generic AVLMap
+    cout << "\nTesting Generic AVLMap:" << endl;
+    {
+        // Integer keys take the branchless comparison; every insert, overwrite and erase must keep the tree balanced
+        AVLMap<long long, int> ids;
+        for (int i = 0; i < 10000; i++)
+            ids.insert((long long)(i * 7919 % 10007) << 32, i);
+        bool mapOk = ids.size() == 10000 && !ids.insert(0, -1) && !ids.insertOrAssign(7919LL << 32, 42) &&
+                     *ids.find(7919LL << 32) == 42;
+        for (int i = 0; i < 10000; i += 2)
+            mapOk = mapOk && ids.erase((long long)(i * 7919 % 10007) << 32);
+        long long previous = -1;
+        int visited = 0;
+        ids.forEach([&](long long key, int)
+                    { mapOk = mapOk && key > previous; previous = key; visited++; });
+        int inRange = 0;
+        ids.forEachInRange(100LL << 32, 199LL << 32, [&](long long, int)
+                           { inRange++; });
+        printTest("Integer Keys - Insert/Erase/Ordered Walk",
+                  mapOk && visited == 5000 && ids.size() == 5000 && ids.height() <= ceil(1.45 * log2(5002)) &&
+                      inRange > 0 && inRange < 100 && !ids.find(0));
+
+        // Fixed-width binary keys compare with memcmp, any other comparator is used as given
+        AVLMap<array<unsigned char, 16>, string> binary;
+        array<unsigned char, 16> low{}, high{};
+        high.fill(0xff);
+        binary.insert(high, "high");
+        binary.insert(low, "low");
+        string order;
+        binary.forEach([&](const array<unsigned char, 16> &, const string &name)
+                       { order += name; });
+        AVLMap<int, int, greater<int>> descending;
+        for (int i = 0; i < 5; i++)
+            descending.insert(i, i * i);
+        int first = -1;
+        descending.forEach([&](int key, int)
+                           { if (first < 0) first = key; });
+        printTest("Byte-Array And Custom Comparator Keys",
+                  order == "lowhigh" && *binary.find(high) == "high" && first == 4 && *descending.find(3) == 9);
+    }
+
+    // Test Group 13: Request Sessions
+    cout << "\nTesting Request Sessions:" << endl;
+    {
+        // Commands split across reads still run once, in order, and each read's runs see the writes before them
+        IndexedDatabase served(true);
+        RequestSession session(served);
+        string replies;
+        string pipelined = "PUT apple 3\r\nPUT pear 5\nGET apple 3\nGET plum 4\nDEL pear 5\nGET pe";
+        session.feed(pipelined.data(), pipelined.size(), replies);
+        string rest = "ar 5\nRANGE 0 10\n";
+        session.feed(rest.data(), rest.size(), replies);
+        printTest("Pipelined Commands - Replies In Order",
+                  replies == "OK\nOK\nFOUND\nNOT_FOUND\nOK\nNOT_FOUND\nRANGE 1\napple 3\n" && served.countRecords() == 1);
+
+        // Bad commands get an error without ending the session; QUIT ends it and nothing after it runs
+        string errors;
+        string bad = "FETCH apple\nPUT apple\nRANGE a b\nQUIT\nPUT late 1\n";
+        bool open = session.feed(bad.data(), bad.size(), errors);
+        printTest("Malformed Commands And QUIT",
+                  errors == "ERR unknown command\nERR usage: PUT key value\nERR usage: RANGE low high\nBYE\n" &&
+                      !open && session.isClosed() && !served.contains("late", 1));
+
+        // Without versioning RANGE formats its records under the read lock, so a writer deleting them waits its turn
+        IndexedDatabase churned(true);
+        for (int i = 0; i < 2000; i++)
+            churned.insert("churn" + to_string(i), i);
+        atomic<bool> stop(false);
+        thread deleter([&]()
+                       {
+            // Each record moves out of the queried range and back, so a freed and reused slot would show a stray value
+            for (int round = 0; !stop; round++)
+                for (int i = 0; i < 2000; i++)
+                {
+                    int from = round % 2 ? i + 5000 : i;
+                    churned.deleteRecord("churn" + to_string(i), from);
+                    churned.insert("churn" + to_string(i), round % 2 ? i : i + 5000);
+                } });
+        RequestSession ranged(churned);
+        bool wellFormed = true;
+        for (int i = 0; i < 200 && wellFormed; i++)
+        {
+            string out, query = "RANGE 0 1999\n";
+            ranged.feed(query.data(), query.size(), out);
+            size_t begin = out.find('\n') + 1, lines = 0;
+            for (size_t end; wellFormed && (end = out.find('\n', begin)) != string::npos; begin = end + 1, lines++)
+            {
+                size_t space = out.rfind(' ', end);
+                int value = stoi(out.substr(space + 1, end - space - 1));
+                wellFormed = out.compare(begin, 5, "churn") == 0 && value >= 0 && value < 2000;
+            }
+            wellFormed = wellFormed && out.compare(0, 6, "RANGE ") == 0 && lines == (size_t)stoi(out.substr(6));
+        }
+        stop = true;
+        deleter.join();
+        printTest("RANGE During Concurrent Deletes", wellFormed && churned.countRecords() == 2000);
+    }
+
+    // Test Group 14: Hot-Key Cache
+    cout << "\nTesting Hot-Key Cache:" << endl;
+    {
+        // A skewed run of lookups is answered from the cache, hits skip the descent entirely
+        IndexedDatabase skewed;
+        for (int i = 0; i < 5000; i++)
+            skewed.insert("item" + to_string(i), i);
+        skewed.enableHotKeyCache(64);
+        auto before = OperationCounters::thisThread();
+        bool allFound = true;
+        for (int i = 0; i < 4000; i++)
+            allFound = allFound && skewed.find("item" + to_string(i % 8 * 611), i % 8 * 611);
+        auto after = OperationCounters::thisThread();
+        OperationStats hitStats;
+        Record *hot = skewed.find("item611", 611, &hitStats);
+        printTest("Skewed Lookups - Served From Cache",
+                  allFound && skewed.hasHotKeyCache() && after.cacheHits - before.cacheHits >= 3990 &&
+                      after.cacheMisses - before.cacheMisses <= 10 && hot && hitStats.comparisons == 0);
+
+        // Deleting a cached record evicts it before it is freed, so the next lookup goes back to the tree
+        skewed.deleteRecord("item611", 611);
+        bool evicted = !skewed.find("item611", 611) && !skewed.search("item611", 611)->key.compare("") &&
+                       skewed.insert("item611", 611) && skewed.find("item611", 611)->value == 611;
+        skewed.applyBatch({{BatchOp::Delete, "item1222", 1222}});
+        bool batchEvicted = !skewed.find("item1222", 1222);
+        skewed.clearDatabase();
+        printTest("Deletes Invalidate Cached Records",
+                  evicted && batchEvicted && !skewed.find("item1833", 1833) && skewed.countRecords() == 0);
+    }
+
+    // Test Group 15: Parallel Scans And Rollups
+    cout << "\nTesting Parallel Scans And Rollups:" << endl;
+    {
+        // Rank slices are cut from subtree sizes, so the stitched result must match the serial scan exactly
+        IndexedDatabase ledger;
+        vector<pair<string, int>> entries;
+        for (int i = 0; i < 120000; i++)
+            entries.push_back({"entry" + to_string(i), (i * 7919) % 50000 - 25000});
+        ledger.bulkLoad(entries);
+        vector<Record *> serial = ledger.rangeQuery(-20000, 30000);
+        printTest("Parallel Range Query - Matches Serial Scan",
+                  ledger.parallelRangeQuery(-20000, 30000) == serial && ledger.parallelRangeQuery(30000, 40000).empty());
+
+        // Subtree sums stay exact through single deletes, batches and the rotations they cause, and aggregate takes
+        // its count, sum, min and max from the same O(log n) descents instead of visiting the range
+        for (int i = 0; i < 120000; i += 3)
+            ledger.deleteRecord("entry" + to_string(i), (i * 7919) % 50000 - 25000);
+        ledger.applyBatch({{BatchOp::Insert, "refund", -30000}, {BatchOp::Delete, "entry1", 7919 - 25000}});
+        vector<Record *> remaining = ledger.rangeQuery(-30000, 1000);
+        long long rollup = 0;
+        for (Record *record : remaining)
+            rollup += record->value;
+        Record *lowest = ledger.minRange(-30000, 1000), *highest = ledger.maxRange(-30000, 1000);
+        RangeAggregate totals = ledger.aggregate(-30000, 1000);
+        printTest("Subtree Sums - O(log n) Range Rollups",
+                  ledger.sumRange(-30000, 1000) == rollup && ledger.sumRange(5, 4) == 0 && lowest &&
+                      lowest->key == "refund" && highest && highest->value == 1000 && !ledger.minRange(25000, 30000) &&
+                      totals.count == (long long)remaining.size() && totals.sum == rollup && totals.min == -30000 &&
+                      totals.max == 1000 && ledger.aggregate(10, 5).count == 0);
+    }
+
+    // Test Group 16: Telemetry
+    cout << "\nTesting Telemetry:" << endl;
+    {
+        // Memory figures come from the allocators' own counts, the shape from a walk or from evenly spaced ranks
+        IndexedDatabase observed;
+        for (int i = 0; i < 20000; i++)
+            observed.insert("metric" + to_string(i * 7919 % 20000), i);
+        DatabaseStats exact = observed.stats(0), sampled = observed.stats(256);
+        size_t balanced = exact.keyIndex.balance[0] + exact.keyIndex.balance[1] + exact.keyIndex.balance[2];
+        printTest("Stats - Memory And Tree Shape",
+                  exact.records == 20000 && exact.nodeBytes == 40000 * sizeof(AVLNode) &&
+                      exact.nodeSlabBytes >= exact.nodeBytes && exact.recordBytes == 20000 * sizeof(Record) &&
+                      exact.keyBytes >= 20000 * 8 && exact.keyIndex.height == observed.getTreeHeight() &&
+                      exact.keyIndex.sampled == 20000 && balanced == 20000 && sampled.keyIndex.sampled == 256 &&
+                      exact.keyIndex.averageDepth > 1 && exact.keyIndex.averageDepth < exact.keyIndex.height &&
+                      fabs(sampled.keyIndex.averageDepth - exact.keyIndex.averageDepth) < 1.0);
+
+        // Every sampled call lands in exactly one latency bucket, and the export carries the same figures
+        observed.enableLatencyTracking(1);
+        auto beforeTiming = OperationCounters::totals();
+        for (int i = 0; i < 100; i++)
+            observed.find("metric" + to_string(i), i);
+        observed.disableLatencyTracking();
+        observed.find("metric0", 0);
+        auto afterTiming = OperationCounters::totals();
+        unsigned long long timed = 0;
+        for (int bucket = 0; bucket < OperationCounters::LatencyBuckets; bucket++)
+            timed += afterTiming.latency[OperationCounters::TimedFind][bucket] - beforeTiming.latency[OperationCounters::TimedFind][bucket];
+        string metrics = observed.metricsText();
+        printTest("Latency Histograms And Prometheus Export",
+                  timed == 100 && metrics.find("avldb_records 20000\n") != string::npos &&
+                      metrics.find("# TYPE avldb_operation_latency_seconds histogram") != string::npos &&
+                      metrics.find("avldb_operation_latency_seconds_bucket{op=\"find\",le=\"+Inf\"}") != string::npos &&
+                      metrics.find("avldb_tree_height " + to_string(observed.getTreeHeight()) + "\n") != string::npos);
     }
 
     // Print Summary
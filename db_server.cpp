@@ -0,0 +1,230 @@
+// db_server.cpp
+// Pipelined TCP front end for IndexedDatabase: a few epoll event loops share one table, no thread per connection.
+// Usage: AVL_Server.exe [--port 7070] [--threads N] [--log path]
+// Commands are one per line and replies come back in order; see RequestSession in AVL_Database.hpp.
+#include "AVL_Database.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef __linux__
+#error "db_server.cpp uses epoll and SO_REUSEPORT, which need Linux"
+#endif
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+    const size_t ReadChunk = 64 * 1024;
+    const size_t MaxPendingOutput = 4 << 20; // Stop reading a client that does not read its replies
+
+    struct Options
+    {
+        int port = 7070;
+        int threads = 1;
+        string logPath;
+    };
+
+    struct Connection
+    {
+        int fd;
+        RequestSession session;
+        string output;
+        size_t sent = 0;      // Bytes of output already written
+        uint32_t events = 0;  // What the connection is registered for in epoll
+        bool finished = false; // The client has stopped sending; close once its replies are written
+
+        Connection(int fd, IndexedDatabase &db) : fd(fd), session(db) {}
+    };
+
+    /*
+    One event loop per thread, each with its own SO_REUSEPORT listener, so the kernel spreads new connections over
+    the loops and none of them share a lock outside the database
+    */
+    class EventLoop
+    {
+    private:
+        IndexedDatabase &db;
+        int epoll;
+        int listener;
+
+        void watch(Connection *connection, uint32_t events)
+        {
+            if (connection->events == events)
+                return;
+            epoll_event event{};
+            event.events = events;
+            event.data.ptr = connection;
+            epoll_ctl(epoll, connection->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection->fd, &event);
+            connection->events = events;
+        }
+
+        void close(Connection *connection)
+        {
+            epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, nullptr);
+            ::close(connection->fd);
+            delete connection;
+        }
+
+        void accept()
+        {
+            while (true)
+            {
+                int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                    return; // EAGAIN once the backlog is empty
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                watch(new Connection(fd, db), EPOLLIN);
+            }
+        }
+
+        // Reads and runs everything the client has sent so far; false on a read error
+        bool readRequests(Connection *connection)
+        {
+            char buffer[ReadChunk];
+            while (connection->output.size() < MaxPendingOutput && !connection->session.isClosed() && !connection->finished)
+            {
+                ssize_t got = read(connection->fd, buffer, sizeof(buffer));
+                if (got > 0)
+                    connection->session.feed(buffer, (size_t)got, connection->output);
+                else if (got == 0)
+                {
+                    connection->finished = true;
+                    return true;
+                }
+                else
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            return true;
+        }
+
+        bool writeReplies(Connection *connection)
+        {
+            while (connection->sent < connection->output.size())
+            {
+                ssize_t put = send(connection->fd, connection->output.data() + connection->sent,
+                                   connection->output.size() - connection->sent, MSG_NOSIGNAL);
+                if (put < 0)
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                connection->sent += (size_t)put;
+            }
+            connection->output.clear();
+            connection->sent = 0;
+            return true;
+        }
+
+        void serve(Connection *connection, uint32_t events)
+        {
+            bool alive = !(events & (EPOLLERR | EPOLLHUP)) || (events & EPOLLIN);
+            if (alive && (events & EPOLLIN))
+                alive = readRequests(connection);
+            if (alive)
+                alive = writeReplies(connection);
+            bool drained = connection->output.empty();
+            bool done = connection->session.isClosed() || connection->finished;
+            if (!alive || (done && drained))
+            {
+                close(connection);
+                return;
+            }
+            uint32_t wanted = drained ? 0u : (uint32_t)EPOLLOUT;
+            if (!done && connection->output.size() < MaxPendingOutput)
+                wanted |= EPOLLIN;
+            watch(connection, wanted);
+        }
+
+    public:
+        EventLoop(IndexedDatabase &db) : db(db), epoll(-1), listener(-1) {}
+
+        bool listen(int port)
+        {
+            listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons((uint16_t)port);
+            if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 1024) != 0)
+                return false;
+            epoll = epoll_create1(EPOLL_CLOEXEC);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr; // The listener is the only entry without a connection
+            return epoll >= 0 && epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) == 0;
+        }
+
+        void run()
+        {
+            epoll_event events[256];
+            while (true)
+            {
+                int ready = epoll_wait(epoll, events, 256, -1);
+                for (int i = 0; i < ready; i++)
+                {
+                    if (!events[i].data.ptr)
+                        accept();
+                    else
+                        serve((Connection *)events[i].data.ptr, events[i].events);
+                }
+            }
+        }
+    };
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--port")
+            options.port = atoi(value.c_str());
+        else if (flag == "--threads")
+            options.threads = max(1, atoi(value.c_str()));
+        else if (flag == "--log")
+            options.logPath = value;
+        else
+        {
+            cerr << "unknown option " << flag << endl;
+            return 1;
+        }
+    }
+
+    IndexedDatabase db(true);
+    if (!options.logPath.empty() && !db.openLog(options.logPath))
+    {
+        cerr << "cannot open log " << options.logPath << endl;
+        return 1;
+    }
+    if (options.threads > 1)
+        db.enableVersioning(); // RANGE replies then read from snapshots instead of holding the read lock writers wait on
+
+    vector<EventLoop> loops(options.threads, EventLoop(db));
+    for (EventLoop &loop : loops)
+        if (!loop.listen(options.port))
+        {
+            cerr << "cannot listen on port " << options.port << endl;
+            return 1;
+        }
+    cout << "listening on port " << options.port << " with " << options.threads << " event loop(s)" << endl;
+
+    vector<thread> workers;
+    for (size_t i = 1; i < loops.size(); i++)
+        workers.emplace_back([&loops, i]()
+                             { loops[i].run(); });
+    loops[0].run();
+    return 0;
+}